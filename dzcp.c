@@ -23,238 +23,5839 @@ along with this program; if not, write to the
 
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdint.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/fs.h>
 #include <errno.h>
 #include <sys/sysinfo.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <sys/time.h>
 #include <string.h>
+#include <dirent.h>
+#include <math.h>
+#include <immintrin.h>
+#include <ctype.h>
+#include <sys/random.h>
+#include <ftw.h>
+#include <signal.h>
 
 #define MAX_RUNS 1000
+/* a worker count within this fraction of the peak is "near peak" */
+#define KNEE_FRACTION 0.95
 #define VER "0.9"
 
+typedef struct CopyEngine CopyEngine;
+
+typedef struct {
+	int num_processes;
+	size_t block_size;
+	double elapsed_time;
+	double throughput;
+	int shift_value;
+	const CopyEngine *engine;
+	int failed;
+	/* background load during the run, see report_interference() */
+	double load_ops;
+	double load_p99;
+	/* streaming tree mode: files copied and the walkers' mean metadata call latency */
+	unsigned long long files;
+	double files_per_sec;
+	double meta_latency;
+} RunResult;
+
+typedef struct {
+	/* transient cgroup v2 directory the workers join, empty when not confined */
+	char path[PATH_MAX];
+	unsigned long long memory_high;
+	unsigned long long memory_max;
+	unsigned long long rbps;
+	unsigned long long wbps;
+} CgroupLimits;
+
+/* settings beyond worker count, block size and engine that shape a copy */
+typedef struct {
+	CgroupLimits cgroup;
+	/* previous version on the destination filesystem to reflink unchanged chunks from */
+	const char *reference_file;
+	/* byte ranges scheduled and flushed before the rest, see plan_build() */
+	const char *priority_spec;
+	/* wall clock time the copy should finish by, 0 to run at full speed */
+	double deadline;
+	/* optimizer only: background load run during each trial, see interference_parse() */
+	const char *interference;
+	/* trace file the workers append their chunks to, see trace_create() */
+	const char *record_file;
+	/* batch and tree mode: files to prepare ahead of the current one, see lookahead() */
+	int lookahead;
+	/* streaming tree mode: files up to small_file bytes are queued by name, metadata_batch per record */
+	off_t small_file;
+	int metadata_batch;
+	/* seconds between throughput samples, 0 for none, see sampler_tick() */
+	double sample_interval;
+	const char *sample_csv;
+} CopyOptions;
+
+/* counters shared by all workers of one copy, updated atomically */
+typedef struct {
+	/* next chunk of the plan to hand out */
+	unsigned long long next_chunk;
+	unsigned long long priority_done_chunks;
+	/* workers may only claim chunks while claimed_bytes stays within budget_bytes */
+	unsigned long long claimed_bytes;
+	unsigned long long budget_bytes;
+	unsigned long long copied_chunks;
+	unsigned long long copied_bytes;
+	unsigned long long cloned_chunks;
+	unsigned long long cloned_bytes;
+	/* workers number themselves from this for the trace */
+	unsigned long long workers_started;
+	/* next file of a batch to prefetch, see lookahead() */
+	unsigned long long prefetch_next;
+	unsigned long long prefetched_files;
+	unsigned long long prefetched_bytes;
+} CopyStats;
+
+#define stat_add(field, value) __atomic_fetch_add(&(field), (value), __ATOMIC_RELAXED)
+
+void about(void) {
+	printf("dzcp: Dragan's Zero-Copy v%s, <dragan@stancevic.com>\n", VER);
+}
+
+static double now_seconds(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+/* parse a byte count with an optional K, M, G or T (binary) suffix */
+unsigned long long parse_size(const char *str) {
+	unsigned long long value;
+	char *end;
+
+	errno = 0;
+	value = strtoull(str, &end, 10);
+	if (errno != 0 || end == str) {
+		fprintf(stderr, "Invalid size '%s'\n", str);
+		exit(1);
+	}
+	switch (*end) {
+		case 'T': case 't': value <<= 10; /* fall through */
+		case 'G': case 'g': value <<= 10; /* fall through */
+		case 'M': case 'm': value <<= 10; /* fall through */
+		case 'K': case 'k': value <<= 10; end++; break;
+		case '\0': break;
+		default:
+			fprintf(stderr, "Invalid size suffix in '%s'\n", str);
+			exit(1);
+	}
+	if (*end != '\0' && strcmp(end, "iB") != 0 && strcmp(end, "B") != 0) {
+		fprintf(stderr, "Invalid size suffix in '%s'\n", str);
+		exit(1);
+	}
+	return value;
+}
+
+/*
+ * a deadline is either a duration from now (90, 90s, 45m, 2h, optionally
+ * prefixed with +) or a wall clock time HH:MM[:SS], taken as the next one
+ */
+double parse_deadline(const char *str) {
+	double now = now_seconds(), value;
+	struct tm tm;
+	time_t t;
+	char *end;
+	int h, m, sec = 0;
+
+	if (strchr(str, ':') != NULL) {
+		if (sscanf(str, "%d:%d:%d", &h, &m, &sec) < 2 || h > 23 || m > 59 || sec > 59) {
+			fprintf(stderr, "Invalid deadline '%s'\n", str);
+			exit(1);
+		}
+		t = time(NULL);
+		localtime_r(&t, &tm);
+		tm.tm_hour = h;
+		tm.tm_min = m;
+		tm.tm_sec = sec;
+		tm.tm_isdst = -1;
+		t = mktime(&tm);
+		if (t <= now)
+			t += 24 * 60 * 60;
+		return t;
+	}
+
+	value = strtod(*str == '+' ? str + 1 : str, &end);
+	switch (*end) {
+		case 'h': value *= 60; /* fall through */
+		case 'm': value *= 60; /* fall through */
+		case 's': end++; break;
+	}
+	if (*end != '\0' || value <= 0) {
+		fprintf(stderr, "Invalid deadline '%s'\n", str);
+		exit(1);
+	}
+	return now + value;
+}
+
+void drop_caches() {
+	FILE *fp = fopen("/proc/sys/vm/drop_caches", "w");
+	if (fp == NULL) {
+		perror("Error opening /proc/sys/vm/drop_caches");
+		exit(1);
+	}
+	fprintf(fp, "3");
+	fclose(fp);
+}
+
+/*
+ * copy engines
+ *
+ * An engine moves one byte range from the source to the destination.
+ * Workers own the file descriptors and hand them to the engine through
+ * an EngineCtx; the engine keeps whatever private state it needs (pipes,
+ * bounce buffers) in the same context between init and teardown.
+ */
+
+/* data never passes through user space */
+#define ENGINE_CAP_ZEROCOPY	0x01
+/* does not move the file offsets, descriptors may be shared */
+#define ENGINE_CAP_POSITIONAL	0x02
+/* works when source and destination are on different filesystems */
+#define ENGINE_CAP_CROSS_FS	0x04
+/* the filesystem may share extents instead of copying data */
+#define ENGINE_CAP_REFLINK	0x08
+
+typedef struct {
+	int source_fd;
+	int dest_fd;
+	size_t block_size;
+	int pipe_fd[2];
+	char *buf;
+} EngineCtx;
+
+struct CopyEngine {
+	const char *name;
+	const char *description;
+	unsigned int caps;
+	/* set up per-worker state, returns 0 on success, -1 with errno set */
+	int (*init)(EngineCtx *ctx);
+	/* copy up to len bytes, returns bytes copied, 0 at EOF, -1 with errno set */
+	ssize_t (*copy_range)(EngineCtx *ctx, off_t src_off, off_t dest_off, size_t len);
+	/* push out anything the engine still holds, returns 0 or -1 */
+	int (*flush)(EngineCtx *ctx);
+	void (*teardown)(EngineCtx *ctx);
+};
+
+static int engine_init_none(EngineCtx *ctx) {
+	return 0;
+}
+
+static int engine_flush_none(EngineCtx *ctx) {
+	return 0;
+}
+
+static void engine_teardown_none(EngineCtx *ctx) {
+}
+
+static ssize_t sendfile_copy_range(EngineCtx *ctx, off_t src_off, off_t dest_off, size_t len) {
+	/* sendfile writes at the current destination offset */
+	if (lseek(ctx->dest_fd, dest_off, SEEK_SET) == (off_t)-1)
+		return -1;
+	return sendfile(ctx->dest_fd, ctx->source_fd, &src_off, len);
+}
+
+static const CopyEngine sendfile_engine = {
+	.name = "sendfile",
+	.description = "sendfile(2) from the source into the seeked destination",
+	.caps = ENGINE_CAP_ZEROCOPY | ENGINE_CAP_CROSS_FS,
+	.init = engine_init_none,
+	.copy_range = sendfile_copy_range,
+	.flush = engine_flush_none,
+	.teardown = engine_teardown_none,
+};
+
+#ifdef SYS_copy_file_range
+static ssize_t copy_file_range_copy_range(EngineCtx *ctx, off_t src_off, off_t dest_off, size_t len) {
+	loff_t in = src_off, out = dest_off;
+
+	return syscall(SYS_copy_file_range, ctx->source_fd, &in, ctx->dest_fd, &out, len, 0);
+}
+
+static const CopyEngine copy_file_range_engine = {
+	.name = "copy_file_range",
+	.description = "copy_file_range(2), in-kernel copy or reflink on the same filesystem",
+	.caps = ENGINE_CAP_ZEROCOPY | ENGINE_CAP_POSITIONAL | ENGINE_CAP_REFLINK,
+	.init = engine_init_none,
+	.copy_range = copy_file_range_copy_range,
+	.flush = engine_flush_none,
+	.teardown = engine_teardown_none,
+};
+#endif
+
+static int splice_init(EngineCtx *ctx) {
+	if (pipe(ctx->pipe_fd) < 0)
+		return -1;
+	/* a pipe as large as a block moves it in one pair of splices */
+	fcntl(ctx->pipe_fd[1], F_SETPIPE_SZ, (int)ctx->block_size);
+	return 0;
+}
+
+static ssize_t splice_copy_range(EngineCtx *ctx, off_t src_off, off_t dest_off, size_t len) {
+	loff_t in = src_off, out = dest_off;
+	ssize_t filled, drained, n;
+
+	filled = splice(ctx->source_fd, &in, ctx->pipe_fd[1], NULL, len, SPLICE_F_MOVE);
+	if (filled <= 0)
+		return filled;
+
+	/* the pipe must be emptied before the next range, even if interrupted */
+	for (drained = 0; drained < filled; drained += n) {
+		n = splice(ctx->pipe_fd[0], NULL, ctx->dest_fd, &out, filled - drained, SPLICE_F_MOVE);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0)
+			return -1;
+	}
+	return filled;
+}
+
+static void splice_teardown(EngineCtx *ctx) {
+	close(ctx->pipe_fd[0]);
+	close(ctx->pipe_fd[1]);
+}
+
+static const CopyEngine splice_engine = {
+	.name = "splice",
+	.description = "splice(2) through a per-worker pipe",
+	.caps = ENGINE_CAP_ZEROCOPY | ENGINE_CAP_POSITIONAL | ENGINE_CAP_CROSS_FS,
+	.init = splice_init,
+	.copy_range = splice_copy_range,
+	.flush = engine_flush_none,
+	.teardown = splice_teardown,
+};
+
+static int readwrite_init(EngineCtx *ctx) {
+	ctx->buf = malloc(ctx->block_size);
+	return ctx->buf == NULL ? -1 : 0;
+}
+
+static ssize_t readwrite_copy_range(EngineCtx *ctx, off_t src_off, off_t dest_off, size_t len) {
+	ssize_t got, put, n;
+
+	if (len > ctx->block_size)
+		len = ctx->block_size;
+	got = pread(ctx->source_fd, ctx->buf, len, src_off);
+	if (got <= 0)
+		return got;
+
+	for (put = 0; put < got; put += n) {
+		n = pwrite(ctx->dest_fd, ctx->buf + put, got - put, dest_off + put);
+		if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+			n = 0;
+			continue;
+		}
+		if (n <= 0)
+			return -1;
+	}
+	return got;
+}
+
+static void readwrite_teardown(EngineCtx *ctx) {
+	free(ctx->buf);
+	ctx->buf = NULL;
+}
+
+static const CopyEngine readwrite_engine = {
+	.name = "readwrite",
+	.description = "pread(2)/pwrite(2) through a per-worker buffer",
+	.caps = ENGINE_CAP_POSITIONAL | ENGINE_CAP_CROSS_FS,
+	.init = readwrite_init,
+	.copy_range = readwrite_copy_range,
+	.flush = engine_flush_none,
+	.teardown = readwrite_teardown,
+};
+
+/* registry of engines built into this binary, the first one is the default */
+static const CopyEngine *engines[] = {
+	&sendfile_engine,
+#ifdef SYS_copy_file_range
+	&copy_file_range_engine,
+#endif
+	&splice_engine,
+	&readwrite_engine,
+	NULL
+};
+
+const CopyEngine *find_engine(const char *name) {
+	for (int i = 0; engines[i] != NULL; i++) {
+		if (strcmp(engines[i]->name, name) == 0)
+			return engines[i];
+	}
+	return NULL;
+}
+
+void list_engines(void) {
+	printf("Available copy engines:\n");
+	for (int i = 0; engines[i] != NULL; i++) {
+		const CopyEngine *e = engines[i];
+		printf("  %-16s %s%s\n", e->name, e->description, i == 0 ? " (default)" : "");
+		printf("  %-16s caps:%s%s%s%s\n", "",
+			   e->caps & ENGINE_CAP_ZEROCOPY ? " zerocopy" : "",
+			   e->caps & ENGINE_CAP_POSITIONAL ? " positional" : "",
+			   e->caps & ENGINE_CAP_CROSS_FS ? " cross-fs" : "",
+			   e->caps & ENGINE_CAP_REFLINK ? " reflink" : "");
+	}
+}
+
+void parent_dir(const char *path, char *dir, size_t size) {
+	char *slash;
+
+	snprintf(dir, size, "%s", path);
+	slash = strrchr(dir, '/');
+	if (slash == NULL)
+		snprintf(dir, size, ".");
+	else if (slash == dir)
+		dir[1] = '\0';
+	else
+		*slash = '\0';
+}
+
+/* the destination may not exist yet, then the directory it goes to counts */
+int stat_dest(const char *dest_file, struct stat *st) {
+	char dir[PATH_MAX];
+
+	if (stat(dest_file, st) == 0)
+		return 0;
+	parent_dir(dest_file, dir, sizeof(dir));
+	return stat(dir, st);
+}
+
+/* compare the source with the directory the destination lives in */
+int same_filesystem(const char *source_file, const char *dest_file) {
+	struct stat src_stat, dest_stat;
+
+	if (stat(source_file, &src_stat) < 0 || stat_dest(dest_file, &dest_stat) < 0)
+		return 0;
+	return src_stat.st_dev == dest_stat.st_dev;
+}
+
+/* an engine is usable if it can cross the filesystem boundary we have */
+int engine_usable(const CopyEngine *engine, const char *source_file, const char *dest_file) {
+	if (engine->caps & ENGINE_CAP_CROSS_FS)
+		return 1;
+	return same_filesystem(source_file, dest_file);
+}
+
+/* copy exactly len bytes unless EOF is reached, returns bytes copied or -1 */
+ssize_t engine_copy_full(const CopyEngine *engine, EngineCtx *ctx, off_t src_off, off_t dest_off, size_t len) {
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = engine->copy_range(ctx, src_off + done, dest_off + done, len - done);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				/* retry in case of interruptions or non-blocking operation */
+				continue;
+			}
+			return -1;
+		}
+		if (n == 0)
+			break;
+		done += n;
+	}
+	return done;
+}
+
+/*
+ * cgroup confinement
+ *
+ * fadvise and friends are only hints. When a copy must not push other
+ * services out of memory, the workers are moved into a transient cgroup v2
+ * child with memory.high/memory.max and io.max set, and the kernel charges
+ * the page cache they dirty against those limits.
+ */
+
+static int write_string(const char *path, const char *value) {
+	int fd, ret = 0;
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	if (write(fd, value, strlen(value)) < 0)
+		ret = -1;
+	close(fd);
+	return ret;
+}
+
+/* where the unified hierarchy is mounted, from /proc/self/mountinfo */
+static int cgroup2_mount_point(char *mnt, size_t size) {
+	char line[4096], point[PATH_MAX], *sep;
+	FILE *fp;
+	int found = 0;
+
+	fp = fopen("/proc/self/mountinfo", "r");
+	if (fp == NULL)
+		return -1;
+	while (!found && fgets(line, sizeof(line), fp) != NULL) {
+		sep = strstr(line, " - ");
+		if (sep == NULL || strncmp(sep + 3, "cgroup2 ", 8) != 0)
+			continue;
+		if (sscanf(line, "%*s %*s %*s %*s %4095s", point) == 1) {
+			snprintf(mnt, size, "%s", point);
+			found = 1;
+		}
+	}
+	fclose(fp);
+	return found ? 0 : -1;
+}
+
+/* does a space separated controller list name this controller */
+static int has_controller(const char *dir, const char *file, const char *controller) {
+	char path[PATH_MAX], list[1024], *tok, *save;
+	FILE *fp;
+	int found = 0;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return 0;
+	if (fgets(list, sizeof(list), fp) != NULL) {
+		for (tok = strtok_r(list, " \n", &save); tok != NULL; tok = strtok_r(NULL, " \n", &save)) {
+			if (strcmp(tok, controller) == 0)
+				found = 1;
+		}
+	}
+	fclose(fp);
+	return found;
+}
+
+/* make sure children of dir get the controller, returns 0 when they do */
+static int enable_controller(const char *dir, const char *controller) {
+	char path[PATH_MAX], value[64];
+
+	if (has_controller(dir, "cgroup.subtree_control", controller))
+		return 0;
+	if (!has_controller(dir, "cgroup.controllers", controller))
+		return -1;
+	snprintf(path, sizeof(path), "%s/cgroup.subtree_control", dir);
+	snprintf(value, sizeof(value), "+%s", controller);
+	return write_string(path, value);
+}
+
+/* io.max takes whole disks, map a filesystem's device to the disk behind it */
+static int disk_of_dev(dev_t device, unsigned int *major_out, unsigned int *minor_out) {
+	char path[PATH_MAX], dev[64];
+	FILE *fp;
+
+	*major_out = major(device);
+	*minor_out = minor(device);
+	/* anonymous devices (tmpfs, overlay, nfs) have no block queue to throttle */
+	if (*major_out == 0)
+		return -1;
+
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition", *major_out, *minor_out);
+	if (access(path, F_OK) != 0)
+		return 0;
+	snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev", *major_out, *minor_out);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return 0;
+	if (fgets(dev, sizeof(dev), fp) != NULL)
+		sscanf(dev, "%u:%u", major_out, minor_out);
+	fclose(fp);
+	return 0;
+}
+
+static int disk_of_file(const char *file, unsigned int *major_out, unsigned int *minor_out) {
+	struct stat st;
+
+	if (stat_dest(file, &st) < 0)
+		return -1;
+	return disk_of_dev(st.st_dev, major_out, minor_out);
+}
+
+static void set_io_max(const CgroupLimits *cg, const char *file, const char *key, unsigned long long bps) {
+	char path[PATH_MAX + 32], value[128];
+	unsigned int maj, min;
+
+	if (disk_of_file(file, &maj, &min) < 0) {
+		fprintf(stderr, "Warning: %s is not on a block device, %s limit not applied to it.\n", file, key);
+		return;
+	}
+	snprintf(path, sizeof(path), "%s/io.max", cg->path);
+	snprintf(value, sizeof(value), "%u:%u %s=%llu", maj, min, key, bps);
+	if (write_string(path, value) < 0)
+		fprintf(stderr, "Warning: could not set io.max '%s': %s\n", value, strerror(errno));
+}
+
+void cgroup_create(CgroupLimits *cg, const char *source_file, const char *dest_dir_file) {
+	char mnt[PATH_MAX - 32], base[PATH_MAX - 32], line[PATH_MAX], path[PATH_MAX + 32], value[64], *slash;
+	int need_io = cg->rbps != 0 || cg->wbps != 0;
+	FILE *fp;
+
+	if (cgroup2_mount_point(mnt, sizeof(mnt)) < 0) {
+		fprintf(stderr, "No cgroup v2 hierarchy is mounted, cannot confine the copy.\n");
+		exit(1);
+	}
+
+	/* start from the cgroup we run in */
+	base[0] = '\0';
+	fp = fopen("/proc/self/cgroup", "r");
+	if (fp != NULL) {
+		while (fgets(line, sizeof(line), fp) != NULL) {
+			if (strncmp(line, "0::", 3) == 0) {
+				line[strcspn(line, "\n")] = '\0';
+				snprintf(base, sizeof(base), "%s%s", mnt, strcmp(line + 3, "/") == 0 ? "" : line + 3);
+			}
+		}
+		fclose(fp);
+	}
+	if (base[0] == '\0')
+		snprintf(base, sizeof(base), "%s", mnt);
+
+	/*
+	 * a cgroup holding processes cannot hand controllers to its children,
+	 * so walk up until one does (systemd delegates them to slices)
+	 */
+	while (enable_controller(base, "memory") < 0 || (need_io && enable_controller(base, "io") < 0)) {
+		if (strcmp(base, mnt) == 0) {
+			fprintf(stderr, "The memory%s not available in %s.\n", need_io ? " and io controllers are" : " controller is", mnt);
+			exit(1);
+		}
+		slash = strrchr(base, '/');
+		*slash = '\0';
+	}
+
+	snprintf(cg->path, sizeof(cg->path), "%s/dzcp-%d", base, (int)getpid());
+	if (mkdir(cg->path, 0755) < 0) {
+		fprintf(stderr, "Error creating cgroup %s: %s\n", cg->path, strerror(errno));
+		exit(1);
+	}
+
+	if (cg->memory_high) {
+		snprintf(path, sizeof(path), "%s/memory.high", cg->path);
+		snprintf(value, sizeof(value), "%llu", cg->memory_high);
+		if (write_string(path, value) < 0)
+			fprintf(stderr, "Warning: could not set memory.high: %s\n", strerror(errno));
+	}
+	if (cg->memory_max) {
+		snprintf(path, sizeof(path), "%s/memory.max", cg->path);
+		snprintf(value, sizeof(value), "%llu", cg->memory_max);
+		if (write_string(path, value) < 0)
+			fprintf(stderr, "Warning: could not set memory.max: %s\n", strerror(errno));
+	}
+	if (cg->rbps)
+		set_io_max(cg, source_file, "rbps", cg->rbps);
+	if (cg->wbps)
+		set_io_max(cg, dest_dir_file, "wbps", cg->wbps);
+
+	printf("Confining workers to cgroup %s\n", cg->path);
+}
+
+/* called in each worker right after fork */
+void cgroup_join(const CgroupLimits *cg) {
+	char path[PATH_MAX + 32];
+
+	if (cg->path[0] == '\0')
+		return;
+	snprintf(path, sizeof(path), "%s/cgroup.procs", cg->path);
+	if (write_string(path, "0") < 0) {
+		perror("Error joining the copy cgroup");
+		exit(1);
+	}
+}
+
+static void print_cgroup_file(const char *dir, const char *name, const char **keys) {
+	char path[PATH_MAX + 32], line[1024], key[256];
+	FILE *fp;
+	int i;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return;
+	printf("%s:\n", name);
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (keys != NULL) {
+			if (sscanf(line, "%255s", key) != 1)
+				continue;
+			for (i = 0; keys[i] != NULL && strcmp(keys[i], key) != 0; i++)
+				;
+			if (keys[i] == NULL)
+				continue;
+		}
+		printf("  %s", line);
+	}
+	fclose(fp);
+}
+
+/* report what the kernel charged to the copy and remove the cgroup */
+void cgroup_finish(CgroupLimits *cg) {
+	static const char *memory_keys[] = {
+		"anon", "file", "file_dirty", "file_writeback", "pgscan", "pgsteal",
+		"workingset_refault_file", "workingset_activate_file", NULL
+	};
+
+	if (cg->path[0] == '\0')
+		return;
+	print_cgroup_file(cg->path, "memory.peak", NULL);
+	print_cgroup_file(cg->path, "memory.stat", memory_keys);
+	print_cgroup_file(cg->path, "memory.events", NULL);
+	print_cgroup_file(cg->path, "io.stat", NULL);
+	if (rmdir(cg->path) < 0)
+		fprintf(stderr, "Warning: could not remove cgroup %s: %s\n", cg->path, strerror(errno));
+	cg->path[0] = '\0';
+}
+
+/* the cgroup of this copy, removed at exit by the process that created it */
+static CgroupLimits *cgroup_owned;
+static pid_t cgroup_owner;
+
+/* an exit on an error path: stop the workers left in the cgroup so it can be removed */
+static void cgroup_cleanup(void) {
+	char path[PATH_MAX + 16];
+
+	if (cgroup_owned == NULL || getpid() != cgroup_owner || cgroup_owned->path[0] == '\0')
+		return;
+	snprintf(path, sizeof(path), "%s/cgroup.kill", cgroup_owned->path);
+	if (write_string(path, "1") == 0)
+		while (wait(NULL) > 0)
+			;
+	cgroup_finish(cgroup_owned);
+}
+
+/* an exit on an error path removes the cgroup, the normal path calls cgroup_finish() itself */
+void cgroup_remove_at_exit(CgroupLimits *cg) {
+	cgroup_owned = cg;
+	cgroup_owner = getpid();
+	atexit(cgroup_cleanup);
+}
+
+/*
+ * incremental copy against a reference
+ *
+ * The reference is an earlier version of the file on the destination
+ * filesystem. Each chunk is compared with the same range of the reference;
+ * identical chunks are reflinked from it with FICLONERANGE so they share
+ * extents, only the chunks that changed are copied by the engine.
+ */
+typedef struct {
+	int fd;
+	off_t size;
+	char *src_buf;
+	char *ref_buf;
+	/* set once the filesystem refuses to reflink, stop comparing after that */
+	int unsupported;
+} Reference;
+
+void reference_open(Reference *ref, const char *reference_file, size_t block_size) {
+	struct stat st;
+
+	ref->fd = open(reference_file, O_RDONLY);
+	if (ref->fd < 0 || fstat(ref->fd, &st) < 0) {
+		perror("Error opening reference file in child process");
+		exit(1);
+	}
+	ref->size = st.st_size;
+	ref->src_buf = malloc(block_size);
+	ref->ref_buf = malloc(block_size);
+	if (ref->src_buf == NULL || ref->ref_buf == NULL) {
+		perror("Failed to allocate reference buffers");
+		exit(1);
+	}
+}
+
+void reference_close(Reference *ref) {
+	free(ref->src_buf);
+	free(ref->ref_buf);
+	close(ref->fd);
+}
+
+static int read_full(int fd, char *buf, size_t len, off_t offset) {
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = pread(fd, buf + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+static int write_full(int fd, const unsigned char *buf, size_t len, off_t offset) {
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < len) {
+		n = pwrite(fd, buf + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		done += n;
+	}
+	return 0;
+}
+
+/* returns 1 when the chunk was cloned from the reference, 0 when it has to be copied */
+int reference_clone(Reference *ref, int source_fd, int dest_fd, off_t offset, size_t len) {
+	struct file_clone_range range;
+
+	if (ref->unsupported || offset + (off_t)len > ref->size)
+		return 0;
+	if (read_full(source_fd, ref->src_buf, len, offset) < 0 || read_full(ref->fd, ref->ref_buf, len, offset) < 0)
+		return 0;
+	if (memcmp(ref->src_buf, ref->ref_buf, len) != 0)
+		return 0;
+
+	range.src_fd = ref->fd;
+	range.src_offset = offset;
+	range.src_length = len;
+	range.dest_offset = offset;
+	/* an unaligned tail or a filesystem without reflink falls back to copying */
+	if (ioctl(dest_fd, FICLONERANGE, &range) < 0) {
+		if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV)
+			ref->unsupported = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * chunk plan
+ *
+ * The files to copy are described as a list of segments cut into block
+ * sized chunks, numbered across segments. Workers claim chunk numbers from
+ * a shared cursor, so whatever is at the front of the plan is copied first.
+ * Priority ranges (a container header, its trailing index) go to the front
+ * and are flushed as soon as the last of their chunks lands. In batch and
+ * tree mode every file is a run of chunks, so a large file is spread over
+ * all workers instead of forming a serial tail.
+ */
+typedef struct {
+	int file;
+	off_t offset;
+	off_t length;
+	unsigned long long first_chunk;
+	int priority;
+} PlanSegment;
+
+typedef struct {
+	char *source;
+	char *dest;
+	off_t size;
+	mode_t mode;
+	/* fewer blocks allocated than the size needs, look for holes */
+	int sparse;
+	/* where byte 0 of the source lands in the destination */
+	off_t dest_offset;
+	/* position in the order the files were given */
+	int index;
+	unsigned long long chunks;
+} FileEntry;
+
+/* per-file completion, shared by the workers */
+typedef struct {
+	unsigned long long chunks_done;
+	double done_at;
+} FileProgress;
+
+typedef struct {
+	PlanSegment *segments;
+	int count;
+	FileEntry *files;
+	int file_count;
+	FileProgress *progress;
+	/* the caller created and sized the destinations, run_plan() leaves them alone */
+	int dest_ready;
+	/* files to prefetch ahead of the one being copied and the bytes to hint for each */
+	int lookahead;
+	off_t prefetch_bytes;
+	size_t block_size;
+	off_t total_bytes;
+	/* bytes in holes of sparse sources, left out of the plan */
+	off_t hole_bytes;
+	unsigned long long total_chunks;
+	unsigned long long priority_chunks;
+	off_t priority_bytes;
+	/* target and name pairs of hardlinks, made once the targets are created */
+	char **links;
+	int link_count;
+	off_t linked_bytes;
+} CopyPlan;
+
+/* orders for batch and tree mode */
+enum {
+	ORDER_GIVEN,
+	ORDER_LARGEST,
+	ORDER_SMALLEST,
+};
+
+typedef struct {
+	off_t offset;
+	off_t length;
+} ByteRange;
+
+int compare_ranges(const void *a, const void *b) {
+	const ByteRange *range_a = (const ByteRange *)a;
+	const ByteRange *range_b = (const ByteRange *)b;
+	return (range_a->offset > range_b->offset) - (range_a->offset < range_b->offset);
+}
+
+static void plan_add(CopyPlan *plan, int file, off_t offset, off_t length, int priority) {
+	PlanSegment *seg;
+	unsigned long long chunks;
+
+	if (length <= 0)
+		return;
+	plan->segments = realloc(plan->segments, (plan->count + 1) * sizeof(PlanSegment));
+	if (plan->segments == NULL) {
+		perror("Failed to allocate memory for the chunk plan");
+		exit(1);
+	}
+	chunks = (length + plan->block_size - 1) / plan->block_size;
+	seg = &plan->segments[plan->count++];
+	seg->file = file;
+	seg->offset = offset;
+	seg->length = length;
+	seg->priority = priority;
+	seg->first_chunk = plan->total_chunks;
+	plan->total_chunks += chunks;
+	plan->files[file].chunks += chunks;
+	if (priority) {
+		plan->priority_chunks += chunks;
+		plan->priority_bytes += length;
+	}
+}
+
+void plan_init(CopyPlan *plan, size_t block_size) {
+	memset(plan, 0, sizeof(*plan));
+	plan->block_size = block_size;
+}
+
+/* register a file, its chunks are added by plan_build() or plan_order() */
+void plan_add_file(CopyPlan *plan, const char *source, const char *dest, off_t size, mode_t mode, int sparse) {
+	FileEntry *file;
+
+	if (plan->file_count % 1024 == 0) {
+		plan->files = realloc(plan->files, (plan->file_count + 1024) * sizeof(FileEntry));
+		if (plan->files == NULL) {
+			perror("Failed to allocate memory for the file list");
+			exit(1);
+		}
+	}
+	file = &plan->files[plan->file_count++];
+	file->source = strdup(source);
+	file->dest = strdup(dest);
+	file->size = size;
+	file->mode = mode & 07777;
+	file->sparse = sparse;
+	file->dest_offset = 0;
+	file->index = plan->file_count - 1;
+	file->chunks = 0;
+	if (file->source == NULL || file->dest == NULL) {
+		perror("Failed to allocate memory for the file list");
+		exit(1);
+	}
+	plan->total_bytes += size;
+}
+
+/*
+ * spec is a comma separated list of head:SIZE, tail:SIZE, ends:SIZE (head and
+ * tail) or OFFSET:LENGTH, sizes take the K/M/G/T suffixes of parse_size()
+ */
+static int parse_priority(const char *spec, off_t file_size, ByteRange **ranges_out) {
+	ByteRange *ranges = NULL;
+	char *copy, *tok, *save, *colon;
+	off_t a, b;
+	int count = 0;
+
+	copy = strdup(spec);
+	for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		colon = strchr(tok, ':');
+		if (colon == NULL) {
+			fprintf(stderr, "Invalid priority range '%s'\n", tok);
+			exit(1);
+		}
+		*colon = '\0';
+		b = parse_size(colon + 1);
+		ranges = realloc(ranges, (count + 2) * sizeof(ByteRange));
+		if (ranges == NULL) {
+			perror("Failed to allocate memory for priority ranges");
+			exit(1);
+		}
+		if (strcmp(tok, "head") == 0 || strcmp(tok, "ends") == 0) {
+			ranges[count].offset = 0;
+			ranges[count++].length = b;
+		}
+		if (strcmp(tok, "tail") == 0 || strcmp(tok, "ends") == 0) {
+			ranges[count].offset = b < file_size ? file_size - b : 0;
+			ranges[count++].length = b;
+		}
+		if (strcmp(tok, "head") != 0 && strcmp(tok, "tail") != 0 && strcmp(tok, "ends") != 0) {
+			a = parse_size(tok);
+			ranges[count].offset = a;
+			ranges[count++].length = b;
+		}
+	}
+	free(copy);
+
+	/* clamp to the file, then sort and merge so no byte is copied twice */
+	for (int i = 0; i < count; i++) {
+		if (ranges[i].offset > file_size)
+			ranges[i].offset = file_size;
+		if (ranges[i].length > file_size - ranges[i].offset)
+			ranges[i].length = file_size - ranges[i].offset;
+	}
+	qsort(ranges, count, sizeof(ByteRange), compare_ranges);
+	int merged = 0;
+	for (int i = 0; i < count; i++) {
+		if (ranges[i].length == 0)
+			continue;
+		if (merged > 0 && ranges[i].offset <= ranges[merged - 1].offset + ranges[merged - 1].length) {
+			off_t end = ranges[i].offset + ranges[i].length;
+			if (end > ranges[merged - 1].offset + ranges[merged - 1].length)
+				ranges[merged - 1].length = end - ranges[merged - 1].offset;
+		} else {
+			ranges[merged++] = ranges[i];
+		}
+	}
+	*ranges_out = ranges;
+	return merged;
+}
+
+/*
+ * add a range of a file, minus the holes of a sparse source: the
+ * destination is sized up front, so what is not copied stays a hole
+ */
+static void plan_add_data(CopyPlan *plan, int file, off_t offset, off_t length, int priority) {
+	off_t pos = offset, end = offset + length, data, hole;
+	int fd;
+
+	if (!plan->files[file].sparse || length <= 0) {
+		plan_add(plan, file, offset, length, priority);
+		return;
+	}
+
+	fd = open(plan->files[file].source, O_RDONLY);
+	while (fd >= 0 && pos < end) {
+		data = lseek(fd, pos, SEEK_DATA);
+		if (data < 0) {
+			/* ENXIO: only a hole is left, anything else: no hole support */
+			if (errno != ENXIO)
+				plan_add(plan, file, pos, end - pos, priority);
+			else
+				plan->hole_bytes += end - pos;
+			break;
+		}
+		if (data >= end) {
+			plan->hole_bytes += end - pos;
+			break;
+		}
+		hole = lseek(fd, data, SEEK_HOLE);
+		if (hole < 0 || hole > end)
+			hole = end;
+		plan->hole_bytes += data - pos;
+		plan_add(plan, file, data, hole - data, priority);
+		pos = hole;
+	}
+	if (fd < 0)
+		plan_add(plan, file, offset, length, priority);
+	else
+		close(fd);
+}
+
+/* plan for a single file, with its priority ranges in front */
+void plan_build(CopyPlan *plan, const char *source_file, const char *dest_file, const struct stat *st, size_t block_size, const char *priority_spec) {
+	ByteRange *ranges = NULL;
+	off_t file_size = st->st_size;
+	int count = 0, i;
+	off_t pos = 0;
+
+	plan_init(plan, block_size);
+	plan_add_file(plan, source_file, dest_file, file_size, 0644, (off_t)st->st_blocks * 512 < file_size);
+
+	if (priority_spec != NULL)
+		count = parse_priority(priority_spec, file_size, &ranges);
+
+	for (i = 0; i < count; i++)
+		plan_add_data(plan, 0, ranges[i].offset, ranges[i].length, 1);
+	/* the gaps between priority ranges follow in file order */
+	for (i = 0; i < count; i++) {
+		plan_add_data(plan, 0, pos, ranges[i].offset - pos, 0);
+		pos = ranges[i].offset + ranges[i].length;
+	}
+	plan_add_data(plan, 0, pos, file_size - pos, 0);
+	free(ranges);
+}
+
+static int compare_largest(const void *a, const void *b) {
+	const FileEntry *file_a = (const FileEntry *)a;
+	const FileEntry *file_b = (const FileEntry *)b;
+	if (file_a->size != file_b->size)
+		return file_a->size < file_b->size ? 1 : -1;
+	/* keep the given order among equal sizes */
+	return file_a->index - file_b->index;
+}
+
+static int compare_smallest(const void *a, const void *b) {
+	const FileEntry *file_a = (const FileEntry *)a;
+	const FileEntry *file_b = (const FileEntry *)b;
+	if (file_a->size != file_b->size)
+		return file_a->size < file_b->size ? -1 : 1;
+	return file_a->index - file_b->index;
+}
+
+/*
+ * lay out the chunks of all registered files in the order asked for:
+ * largest first (LPT) keeps the makespan short, smallest first minimizes
+ * the mean time until each file is complete, given keeps the order of the
+ * command line, manifest or directory walk
+ */
+void plan_order(CopyPlan *plan, int order) {
+	int i;
+
+	if (order == ORDER_LARGEST)
+		qsort(plan->files, plan->file_count, sizeof(FileEntry), compare_largest);
+	else if (order == ORDER_SMALLEST)
+		qsort(plan->files, plan->file_count, sizeof(FileEntry), compare_smallest);
+
+	for (i = 0; i < plan->file_count; i++)
+		plan_add_data(plan, i, 0, plan->files[i].size, 0);
+}
+
+void plan_free(CopyPlan *plan) {
+	for (int i = 0; i < plan->file_count; i++) {
+		free(plan->files[i].source);
+		free(plan->files[i].dest);
+	}
+	for (int i = 0; i < plan->link_count * 2; i++)
+		free(plan->links[i]);
+	free(plan->links);
+	plan->links = NULL;
+	plan->link_count = 0;
+	free(plan->files);
+	free(plan->segments);
+	plan->files = NULL;
+	plan->file_count = 0;
+	plan->segments = NULL;
+	plan->count = 0;
+}
+
+/* map a chunk number to its byte range, returns the segment it falls in */
+const PlanSegment *plan_chunk(const CopyPlan *plan, unsigned long long chunk, off_t *offset, size_t *len) {
+	int lo = 0, hi = plan->count - 1, mid;
+	const PlanSegment *seg;
+	off_t end;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (plan->segments[mid].first_chunk <= chunk)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	seg = &plan->segments[lo];
+	*offset = seg->offset + (off_t)(chunk - seg->first_chunk) * plan->block_size;
+	end = seg->offset + seg->length;
+	*len = end - *offset < (off_t)plan->block_size ? (size_t)(end - *offset) : plan->block_size;
+	return seg;
+}
+
+/*
+ * point-in-time source snapshot
+ *
+ * FICLONE shares the source's extents with an anonymous file on the same
+ * filesystem in one metadata operation, so a live writer only has to pause
+ * for that long. The clone is never linked into the namespace (O_TMPFILE,
+ * or unlinked right away), workers reach it through /proc/self/fd which
+ * they inherit, and it disappears with the last descriptor.
+ */
+int snapshot_source(const char *source_file, char *snapshot_path, size_t size) {
+	char dir[PATH_MAX], tmp[PATH_MAX + 32];
+	int src_fd, snap_fd;
+	double start;
+
+	parent_dir(source_file, dir, sizeof(dir));
+
+	src_fd = open(source_file, O_RDONLY);
+	if (src_fd < 0) {
+		perror("Error opening source file for snapshot");
+		exit(1);
+	}
+
+	snap_fd = open(dir, O_TMPFILE | O_RDWR, 0600);
+	if (snap_fd < 0) {
+		/* filesystems without O_TMPFILE get a named file, unlinked right away */
+		snprintf(tmp, sizeof(tmp), "%s/.dzcp-snapshot-XXXXXX", dir);
+		snap_fd = mkstemp(tmp);
+		if (snap_fd < 0) {
+			perror("Error creating snapshot file");
+			exit(1);
+		}
+		unlink(tmp);
+	}
+
+	start = now_seconds();
+	if (ioctl(snap_fd, FICLONE, src_fd) < 0) {
+		fprintf(stderr, "Error cloning source for snapshot: %s\n", strerror(errno));
+		if (errno == EOPNOTSUPP || errno == EINVAL || errno == ENOTTY)
+			fprintf(stderr, "Snapshots need a filesystem with reflink support (btrfs, XFS).\n");
+		exit(1);
+	}
+	printf("Source snapshot taken in %.3f ms.\n", (now_seconds() - start) * 1000.0);
+	close(src_fd);
+
+	snprintf(snapshot_path, size, "/proc/self/fd/%d", snap_fd);
+	return snap_fd;
+}
+
+/*
+ * trace recording and replay
+ *
+ * --record FILE makes every worker append one fixed-size record per chunk
+ * to FILE, with O_APPEND so the records of concurrent workers never mix:
+ * when the chunk started, how long it took, where it was and which worker
+ * copied it. --replay FILE issues the same chunks against any source and
+ * destination, one process per recorded worker, either on the recorded
+ * schedule or as fast as possible (--replay-fast), and compares the
+ * latencies with the recorded ones. Chunks of a batch are laid out one
+ * file after another. Chunks the recording cloned from a reference are
+ * cloned again from the -r file given to the replay, or skipped without
+ * one; either way they are compared apart from the engine copies.
+ */
+#define TRACE_MAGIC	"dzcptrc"
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t workers;
+	uint32_t files;
+	uint64_t block_size;
+	uint64_t total_bytes;
+	char engine[32];
+	/* wall clock time the copy started */
+	double started;
+} TraceHeader;
+
+#define TRACE_COPY	0
+#define TRACE_CLONE	1
+/* replay only: a clone record replayed without a reference */
+#define TRACE_SKIPPED	2
+
+typedef struct {
+	/* seconds from the start of the copy */
+	double start;
+	double latency;
+	uint64_t offset;
+	uint64_t length;
+	uint32_t worker;
+	uint32_t file;
+	/* TRACE_COPY through the header's engine, or TRACE_CLONE from the reference */
+	uint32_t op;
+	uint32_t priority;
+} TraceRecord;
+
+void trace_create(const char *path, const CopyPlan *plan, int num_processes, const CopyEngine *engine, double started) {
+	TraceHeader hdr;
+	int fd;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	hdr.version = 1;
+	hdr.record_size = sizeof(TraceRecord);
+	hdr.workers = num_processes;
+	hdr.files = plan->file_count;
+	hdr.block_size = plan->block_size;
+	hdr.total_bytes = plan->total_bytes;
+	snprintf(hdr.engine, sizeof(hdr.engine), "%s", engine->name);
+	hdr.started = started;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+		perror("Error creating the trace");
+		exit(1);
+	}
+	close(fd);
+}
+
+static int compare_trace_records(const void *a, const void *b) {
+	const TraceRecord *rec_a = (const TraceRecord *)a;
+	const TraceRecord *rec_b = (const TraceRecord *)b;
+	return (rec_a->start > rec_b->start) - (rec_a->start < rec_b->start);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static void print_latencies(const char *what, double *lat, size_t count) {
+	double sum = 0.0;
+
+	qsort(lat, count, sizeof(double), compare_doubles);
+	for (size_t i = 0; i < count; i++)
+		sum += lat[i];
+	printf("  %-9s mean %8.3f ms, p50 %8.3f ms, p99 %8.3f ms, max %8.3f ms\n", what, sum / count * 1000.0,
+		   lat[count / 2] * 1000.0, lat[(size_t)(count * 0.99)] * 1000.0, lat[count - 1] * 1000.0);
+}
+
+/* the replayed and recorded latencies of the chunks replayed as op */
+static void print_replay_latencies(const TraceRecord *recs, const double *lat, const unsigned char *replayed_op,
+								   size_t count, uint32_t op, double *scratch) {
+	size_t i, n = 0;
+
+	for (i = 0; i < count; i++)
+		if (replayed_op[i] == op)
+			scratch[n++] = lat[i];
+	if (n == 0)
+		return;
+	print_latencies("replayed", scratch, n);
+	n = 0;
+	for (i = 0; i < count; i++)
+		if (replayed_op[i] == op)
+			scratch[n++] = recs[i].latency;
+	print_latencies("recorded", scratch, n);
+}
+
+int replay_trace(const char *trace_file, const char *source_file, const char *dest_file, const CopyEngine *engine,
+				 const char *reference_file, int fast) {
+	TraceRecord *recs;
+	TraceHeader hdr;
+	off_t *file_base, end, need;
+	double *lat, *lag, *scratch, start, elapsed, lag_sum = 0.0, t, recorded = 0.0;
+	unsigned long long bytes = 0, clone_bytes = 0, skipped_bytes = 0;
+	unsigned char *replayed_op;
+	size_t count, i, clones = 0, copies = 0, skipped = 0;
+	uint32_t workers = 0, w;
+	int fd, status, failed = 0;
+	struct stat st;
+	pid_t pid;
+
+	fd = open(trace_file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0 || read_full(fd, (char *)&hdr, sizeof(hdr), 0) < 0 ||
+		memcmp(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 || hdr.version != 1 || hdr.record_size != sizeof(TraceRecord)) {
+		fprintf(stderr, "%s is not a dzcp trace.\n", trace_file);
+		exit(1);
+	}
+	count = (st.st_size - sizeof(hdr)) / sizeof(TraceRecord);
+	recs = malloc(count * sizeof(TraceRecord) + 1);
+	file_base = calloc(hdr.files + 1, sizeof(off_t));
+	if (recs == NULL || file_base == NULL || read_full(fd, (char *)recs, count * sizeof(TraceRecord), sizeof(hdr)) < 0) {
+		perror("Error reading the trace");
+		exit(1);
+	}
+	close(fd);
+	if (count == 0) {
+		printf("The trace has no chunks.\n");
+		return 0;
+	}
+
+	/* lay the files of a batch out one after another */
+	for (i = 0; i < count; i++) {
+		if (recs[i].file >= hdr.files) {
+			fprintf(stderr, "%s is damaged.\n", trace_file);
+			exit(1);
+		}
+		end = recs[i].offset + recs[i].length;
+		if (end > file_base[recs[i].file + 1])
+			file_base[recs[i].file + 1] = end;
+		if (recs[i].worker + 1 > workers)
+			workers = recs[i].worker + 1;
+		bytes += recs[i].length;
+		if (recs[i].start + recs[i].latency > recorded)
+			recorded = recs[i].start + recs[i].latency;
+	}
+	for (w = 0; w < hdr.files; w++)
+		file_base[w + 1] += file_base[w];
+	need = file_base[hdr.files];
+	if (stat(source_file, &st) < 0 || st.st_size < need) {
+		fprintf(stderr, "The replay source must hold at least %lld bytes.\n", (long long)need);
+		exit(1);
+	}
+	/* records are appended in completion order, replay each worker's in start order */
+	qsort(recs, count, sizeof(TraceRecord), compare_trace_records);
+
+	if (engine == NULL)
+		engine = find_engine(hdr.engine);
+	if (engine == NULL)
+		engine = engines[0];
+	fd = open(dest_file, O_WRONLY | O_CREAT, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "Error opening destination file %s: %s\n", dest_file, strerror(errno));
+		exit(1);
+	}
+	close(fd);
+
+	if (reference_file != NULL && !same_filesystem(reference_file, dest_file)) {
+		fprintf(stderr, "The reference file must be on the destination filesystem.\n");
+		exit(1);
+	}
+	lat = mmap(NULL, 2 * count * sizeof(double) + count, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	scratch = malloc(count * sizeof(double));
+	if (lat == MAP_FAILED || scratch == NULL) {
+		perror("Error mapping shared statistics");
+		exit(1);
+	}
+	lag = lat + count;
+	/* what each chunk was replayed as: TRACE_COPY, TRACE_CLONE or TRACE_SKIPPED */
+	replayed_op = (unsigned char *)(lag + count);
+	printf("Replaying %zu chunks (%.2f MiB) of %u workers using %s, %s.\n", count, bytes / (1024.0 * 1024.0),
+		   workers, engine->name, fast ? "as fast as possible" : "on the recorded schedule");
+
+	start = now_seconds();
+	fflush(NULL);
+	for (w = 0; w < workers; w++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("Error forking process");
+			exit(1);
+		} else if (pid == 0) {
+			EngineCtx ctx = { .block_size = hdr.block_size, .pipe_fd = { -1, -1 } };
+			struct file_clone_range range;
+			int ref_fd = -1;
+			off_t pos;
+
+			ctx.source_fd = open(source_file, O_RDONLY);
+			ctx.dest_fd = open(dest_file, O_WRONLY);
+			if (reference_file != NULL && (ref_fd = open(reference_file, O_RDONLY)) < 0) {
+				fprintf(stderr, "Error opening reference file %s: %s\n", reference_file, strerror(errno));
+				exit(1);
+			}
+			if (ctx.source_fd < 0 || ctx.dest_fd < 0 || engine->init(&ctx) < 0) {
+				perror("Error preparing replay worker");
+				exit(1);
+			}
+			for (i = 0; i < count; i++) {
+				if (recs[i].worker != w)
+					continue;
+				t = now_seconds() - start;
+				if (!fast && t < recs[i].start) {
+					usleep((recs[i].start - t) * 1000000.0);
+					t = now_seconds() - start;
+				}
+				lag[i] = fast ? 0.0 : t - recs[i].start;
+				pos = file_base[recs[i].file] + recs[i].offset;
+				if (recs[i].op == TRACE_CLONE && ref_fd < 0) {
+					replayed_op[i] = TRACE_SKIPPED;
+					continue;
+				}
+				if (recs[i].op == TRACE_CLONE) {
+					range.src_fd = ref_fd;
+					range.src_offset = pos;
+					range.src_length = recs[i].length;
+					range.dest_offset = pos;
+					if (ioctl(ctx.dest_fd, FICLONERANGE, &range) < 0) {
+						fprintf(stderr, "Error cloning from %s: %s\n", reference_file, strerror(errno));
+						exit(1);
+					}
+					replayed_op[i] = TRACE_CLONE;
+				} else {
+					if (engine_copy_full(engine, &ctx, pos, pos, recs[i].length) < 0 || engine->flush(&ctx) < 0) {
+						fprintf(stderr, "Error during %s: %s\n", engine->name, strerror(errno));
+						exit(1);
+					}
+					replayed_op[i] = TRACE_COPY;
+				}
+				lat[i] = now_seconds() - start - t;
+			}
+			engine->teardown(&ctx);
+			if (ref_fd >= 0)
+				close(ref_fd);
+			exit(0);
+		}
+	}
+	for (w = 0; w < workers; w++) {
+		if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = 1;
+	}
+	elapsed = now_seconds() - start;
+	if (failed) {
+		fprintf(stderr, "Replay failed.\n");
+		exit(1);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (replayed_op[i] == TRACE_SKIPPED) {
+			skipped++;
+			skipped_bytes += recs[i].length;
+			continue;
+		}
+		if (replayed_op[i] == TRACE_CLONE) {
+			clones++;
+			clone_bytes += recs[i].length;
+		} else {
+			copies++;
+		}
+		lag_sum += lag[i];
+	}
+	printf("Operation completed in %.2f seconds (recorded %.2f seconds).\n", elapsed, recorded);
+	printf("Throughput: %.2f MiB/s\n", (bytes - skipped_bytes) / (1024.0 * 1024.0) / elapsed);
+	if (copies > 0) {
+		printf("Chunk latency of %zu engine copies:\n", copies);
+		print_replay_latencies(recs, lat, replayed_op, count, TRACE_COPY, scratch);
+	}
+	if (clones > 0) {
+		printf("Chunk latency of %zu clones (%.2f MiB) from the reference:\n", clones, clone_bytes / (1024.0 * 1024.0));
+		print_replay_latencies(recs, lat, replayed_op, count, TRACE_CLONE, scratch);
+	}
+	if (skipped > 0)
+		printf("Skipped %zu chunks (%.2f MiB) the recording cloned from its reference, give -r to clone them.\n",
+			   skipped, skipped_bytes / (1024.0 * 1024.0));
+	if (!fast && copies + clones > 0)
+		printf("  issued on average %.3f ms behind the recorded schedule\n", lag_sum / (copies + clones) * 1000.0);
+
+	munmap(lat, 2 * count * sizeof(double) + count);
+	free(scratch);
+	free(recs);
+	free(file_base);
+	return 0;
+}
+
+/*
+ * cross-file lookahead
+ *
+ * Between files the devices idle while the next file is opened and its
+ * first reads wait on the disk. With --lookahead N, whoever starts a file
+ * prepares the next N: their inodes are looked up, their first bytes are
+ * hinted with WILLNEED, and their destinations are preallocated, so that
+ * work overlaps with copying the current file. The bytes hinted per file
+ * are bounded so the window as a whole stays within LOOKAHEAD_MEMORY.
+ */
+#define LOOKAHEAD_MEMORY	(64 * 1024 * 1024)
+
+/* returns the bytes hinted */
+static off_t prefetch_file(const char *source, const char *dest, off_t size, int sparse, off_t bytes) {
+	int fd;
+
+	fd = open(source, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (bytes > size)
+		bytes = size;
+	if (bytes > 0)
+		posix_fadvise(fd, 0, bytes, POSIX_FADV_WILLNEED);
+	close(fd);
+
+	/* a sparse destination keeps its holes */
+	if (!sparse && size > 0) {
+		fd = open(dest, O_WRONLY);
+		if (fd >= 0) {
+			fallocate(fd, 0, 0, size);
+			close(fd);
+		}
+	}
+	return bytes;
+}
+
+/* prepare the files after file, up to the lookahead, each by one worker only */
+static void lookahead(const CopyPlan *plan, int file, CopyStats *stats) {
+	unsigned long long next, target = file + 1 + plan->lookahead;
+	const FileEntry *entry;
+
+	if (target > (unsigned long long)plan->file_count)
+		target = plan->file_count;
+	while ((next = __atomic_load_n(&stats->prefetch_next, __ATOMIC_RELAXED)) < target) {
+		if (next <= (unsigned long long)file) {
+			/* already being copied */
+			__atomic_compare_exchange_n(&stats->prefetch_next, &next, file + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (!__atomic_compare_exchange_n(&stats->prefetch_next, &next, next + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;
+		entry = &plan->files[next];
+		stat_add(stats->prefetched_bytes, prefetch_file(entry->source, entry->dest, entry->size, entry->sparse, plan->prefetch_bytes));
+		stat_add(stats->prefetched_files, 1);
+	}
+}
+
+/* switch a worker's descriptors to another file of the plan */
+static void open_plan_file(EngineCtx *ctx, const FileEntry *file, const FileEntry *prev) {
+	if (ctx->source_fd >= 0)
+		close(ctx->source_fd);
+	/* pieces of one destination (a restore) keep it open */
+	if (prev != NULL && strcmp(prev->dest, file->dest) == 0)
+		goto open_source;
+	if (ctx->dest_fd >= 0)
+		close(ctx->dest_fd);
+
+	ctx->dest_fd = open(file->dest, O_WRONLY);
+	if (ctx->dest_fd < 0) {
+		fprintf(stderr, "Error opening destination file %s in child process: %s\n", file->dest, strerror(errno));
+		exit(1);
+	}
+
+open_source:
+	ctx->source_fd = open(file->source, O_RDONLY);
+	if (ctx->source_fd < 0) {
+		fprintf(stderr, "Error opening source file %s in child process: %s\n", file->source, strerror(errno));
+		exit(1);
+	}
+}
+
+void copy_blocks(const CopyPlan *plan, double start_time, const CopyEngine *engine, const CopyOptions *opts, CopyStats *stats) {
+	unsigned long long chunk, claimed;
+	const PlanSegment *seg;
+	off_t offset;
+	size_t len;
+	int current = -1, trace_fd = -1;
+	TraceRecord rec = { 0 };
+	Reference ref = { .fd = -1 };
+	EngineCtx ctx = { .source_fd = -1, .dest_fd = -1, .block_size = plan->block_size, .pipe_fd = { -1, -1 } };
+
+	if (engine->init(&ctx) < 0) {
+		fprintf(stderr, "Error initializing %s engine: %s\n", engine->name, strerror(errno));
+		exit(1);
+	}
+
+	if (opts->reference_file != NULL)
+		reference_open(&ref, opts->reference_file, plan->block_size);
+
+	if (opts->record_file != NULL) {
+		trace_fd = open(opts->record_file, O_WRONLY | O_APPEND);
+		if (trace_fd < 0) {
+			perror("Error opening the trace");
+			exit(1);
+		}
+		rec.worker = __atomic_fetch_add(&stats->workers_started, 1, __ATOMIC_RELAXED);
+	}
+
+	/* claim chunks in plan order until the plan is exhausted */
+	while ((chunk = __atomic_fetch_add(&stats->next_chunk, 1, __ATOMIC_RELAXED)) < plan->total_chunks) {
+		seg = plan_chunk(plan, chunk, &offset, &len);
+
+		/* each process opens its own source and destination file descriptors */
+		if (seg->file != current) {
+			if (current >= 0 && engine->flush(&ctx) < 0) {
+				fprintf(stderr, "Error flushing %s engine: %s\n", engine->name, strerror(errno));
+				exit(1);
+			}
+			open_plan_file(&ctx, &plan->files[seg->file], current >= 0 ? &plan->files[current] : NULL);
+			current = seg->file;
+			if (plan->lookahead > 0)
+				lookahead(plan, current, stats);
+		}
+
+		/* a paced copy waits until the supervisor has handed out enough budget */
+		claimed = __atomic_add_fetch(&stats->claimed_bytes, len, __ATOMIC_RELAXED);
+		while (claimed > __atomic_load_n(&stats->budget_bytes, __ATOMIC_RELAXED))
+			usleep(1000);
+
+		/* print offsets being written */
+		// printf("process %d: writing chunk %llu at offset %lld\n", getpid(), chunk, (long long)offset);
+
+		rec.start = now_seconds() - start_time;
+		if (ref.fd >= 0 && reference_clone(&ref, ctx.source_fd, ctx.dest_fd, offset, len)) {
+			stat_add(stats->cloned_chunks, 1);
+			stat_add(stats->cloned_bytes, len);
+			rec.op = TRACE_CLONE;
+		} else {
+			if (engine_copy_full(engine, &ctx, offset, offset + plan->files[seg->file].dest_offset, len) < 0) {
+				fprintf(stderr, "Error during %s: %s\n", engine->name, strerror(errno));
+				engine->teardown(&ctx);
+				close(ctx.source_fd);
+				close(ctx.dest_fd);
+				exit(1);
+			}
+			stat_add(stats->copied_chunks, 1);
+			stat_add(stats->copied_bytes, len);
+			rec.op = TRACE_COPY;
+		}
+		if (trace_fd >= 0) {
+			rec.latency = now_seconds() - start_time - rec.start;
+			rec.offset = offset;
+			rec.length = len;
+			rec.file = seg->file;
+			rec.priority = seg->priority;
+			if (write(trace_fd, &rec, sizeof(rec)) != sizeof(rec))
+				perror("Error writing the trace");
+		}
+
+		/* whoever lands the last priority chunk makes the priority ranges durable */
+		if (seg->priority && __atomic_add_fetch(&stats->priority_done_chunks, 1, __ATOMIC_ACQ_REL) == plan->priority_chunks) {
+			if (engine->flush(&ctx) < 0 || fdatasync(ctx.dest_fd) < 0)
+				perror("Error flushing priority ranges");
+			printf("Priority ranges (%.2f MiB) copied and flushed after %.2f seconds.\n",
+				   plan->priority_bytes / (1024.0 * 1024.0), now_seconds() - start_time);
+			fflush(stdout);
+		}
+
+		/* and whoever lands the last chunk of a file notes when it was complete */
+		if (__atomic_add_fetch(&plan->progress[seg->file].chunks_done, 1, __ATOMIC_ACQ_REL) == plan->files[seg->file].chunks)
+			plan->progress[seg->file].done_at = now_seconds() - start_time;
+	}
+
+	if (current >= 0 && engine->flush(&ctx) < 0) {
+		fprintf(stderr, "Error flushing %s engine: %s\n", engine->name, strerror(errno));
+		exit(1);
+	}
+	engine->teardown(&ctx);
+	if (ref.fd >= 0)
+		reference_close(&ref);
+	if (trace_fd >= 0)
+		close(trace_fd);
+
+	/* close file descriptors after done */
+	if (current >= 0) {
+		close(ctx.source_fd);
+		close(ctx.dest_fd);
+	}
+}
+
+/*
+ * hardlinks
+ *
+ * Tree mode copies the data of a file with several names once and makes
+ * the other names with link(). Files with st_nlink > 1 are looked up by
+ * (st_dev, st_ino) in an open addressing table in shared memory, so the
+ * walkers of a streaming copy can share it. A slot is claimed with a
+ * compare-and-swap; the claiming name publishes its destination path once
+ * the file exists, and later names wait for that before linking to it.
+ * The mappings are reserved, not committed, so memory grows with the
+ * number of linked inodes only.
+ */
+#define LINK_SLOTS	(1 << 20)
+#define LINK_ARENA	(256 * 1024 * 1024)
+
+#define LINK_EMPTY	0
+/* claimed, the key is being written */
+#define LINK_CLAIMED	1
+/* keyed, the first name's destination does not exist yet */
+#define LINK_KEYED	2
+#define LINK_READY	3
+
+typedef struct {
+	unsigned int state;
+	unsigned long long dev;
+	unsigned long long ino;
+	/* the first name's destination path, in the arena */
+	unsigned long long path;
+} LinkSlot;
+
+typedef struct {
+	LinkSlot *slots;
+	char *arena;
+	/* first word of the arena: bytes of it in use */
+	unsigned long long *arena_used;
+	unsigned long long *linked_names;
+	unsigned long long *linked_bytes;
+} LinkTable;
+
+void link_table_init(LinkTable *table) {
+	table->slots = mmap(NULL, LINK_SLOTS * sizeof(LinkSlot), PROT_READ | PROT_WRITE,
+						MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	table->arena = mmap(NULL, LINK_ARENA, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (table->slots == MAP_FAILED || table->arena == MAP_FAILED) {
+		perror("Error mapping the hardlink table");
+		exit(1);
+	}
+	table->arena_used = (unsigned long long *)table->arena;
+	table->linked_names = table->arena_used + 1;
+	table->linked_bytes = table->arena_used + 2;
+	*table->arena_used = 3 * sizeof(unsigned long long);
+}
+
+void link_table_free(LinkTable *table) {
+	munmap(table->slots, LINK_SLOTS * sizeof(LinkSlot));
+	munmap(table->arena, LINK_ARENA);
+}
+
+/*
+ * returns the slot the caller claimed for a new inode, which it publishes
+ * with link_publish() once its destination exists, or -1 if the inode is
+ * already claimed (*first is then its destination), or when the table is
+ * full (*first is then NULL and the file is copied as usual)
+ */
+long link_claim(LinkTable *table, const struct stat *st, const char **first) {
+	unsigned long long hash = (st->st_ino ^ ((unsigned long long)st->st_dev << 40)) * 0x9e3779b97f4a7c15ULL;
+	unsigned int state;
+	LinkSlot *slot;
+	long i, n;
+
+	*first = NULL;
+	for (n = 0, i = hash >> 44; n < LINK_SLOTS; n++, i = (i + 1) & (LINK_SLOTS - 1)) {
+		slot = &table->slots[i];
+		state = LINK_EMPTY;
+		if (__atomic_compare_exchange_n(&slot->state, &state, LINK_CLAIMED, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			slot->dev = st->st_dev;
+			slot->ino = st->st_ino;
+			__atomic_store_n(&slot->state, LINK_KEYED, __ATOMIC_RELEASE);
+			return i;
+		}
+		while ((state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE)) == LINK_CLAIMED)
+			usleep(100);
+		if (slot->dev != (unsigned long long)st->st_dev || slot->ino != (unsigned long long)st->st_ino)
+			continue;
+		while (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != LINK_READY)
+			usleep(100);
+		*first = table->arena + slot->path;
+		return -1;
+	}
+	return -1;
+}
+
+void link_publish(LinkTable *table, long i, const char *dest) {
+	size_t len = strlen(dest) + 1;
+	unsigned long long at;
+
+	at = __atomic_fetch_add(table->arena_used, len, __ATOMIC_RELAXED);
+	if (at + len > LINK_ARENA) {
+		fprintf(stderr, "Too many hardlinked files, the hardlink table is full.\n");
+		exit(1);
+	}
+	memcpy(table->arena + at, dest, len);
+	table->slots[i].path = at;
+	__atomic_store_n(&table->slots[i].state, LINK_READY, __ATOMIC_RELEASE);
+}
+
+/* make dest another name of first, 0 on success */
+int link_name(LinkTable *table, const char *first, const char *dest, off_t size) {
+	unlink(dest);
+	if (link(first, dest) < 0) {
+		fprintf(stderr, "Error linking %s to %s, copying it instead: %s\n", dest, first, strerror(errno));
+		return -1;
+	}
+	stat_add(*table->linked_names, 1);
+	stat_add(*table->linked_bytes, size);
+	return 0;
+}
+
+/*
+ * batch and tree mode
+ *
+ * Batch mode copies several files into a directory, from the command line
+ * or a manifest; tree mode copies a directory recursively. Both register
+ * every regular file in one plan so all workers share a single queue of
+ * chunks, laid out by plan_order().
+ */
+
+static char *path_join(const char *dir, const char *name) {
+	char *path;
+
+	if (asprintf(&path, "%s/%s", dir, name) < 0) {
+		perror("Failed to allocate memory for a path");
+		exit(1);
+	}
+	return path;
+}
+
+void batch_add(CopyPlan *plan, const char *source, const char *dest) {
+	struct stat st;
+
+	if (stat(source, &st) < 0) {
+		fprintf(stderr, "Error getting status of %s: %s\n", source, strerror(errno));
+		exit(1);
+	}
+	if (!S_ISREG(st.st_mode)) {
+		fprintf(stderr, "Skipping %s, not a regular file\n", source);
+		return;
+	}
+	plan_add_file(plan, source, dest, st.st_size, st.st_mode, (off_t)st.st_blocks * 512 < st.st_size);
+}
+
+/* sources named on the command line land in dest_dir under their own name */
+void batch_add_args(CopyPlan *plan, char **sources, int count, const char *dest_dir) {
+	const char *base;
+	char *dest;
+
+	for (int i = 0; i < count; i++) {
+		base = strrchr(sources[i], '/');
+		base = base != NULL ? base + 1 : sources[i];
+		dest = path_join(dest_dir, base);
+		batch_add(plan, sources[i], dest);
+		free(dest);
+	}
+}
+
+/*
+ * a manifest has one SOURCE or SOURCE<TAB>DEST per line, a relative DEST
+ * and a missing one (the source's base name) are taken relative to dest_dir
+ */
+void batch_add_manifest(CopyPlan *plan, const char *manifest, const char *dest_dir) {
+	char *line = NULL, *tab, *dest;
+	const char *name;
+	size_t size = 0;
+	ssize_t n;
+	FILE *fp;
+
+	fp = fopen(manifest, "r");
+	if (fp == NULL) {
+		perror("Error opening manifest");
+		exit(1);
+	}
+	while ((n = getline(&line, &size, fp)) > 0) {
+		if (line[n - 1] == '\n')
+			line[--n] = '\0';
+		if (n == 0 || line[0] == '#')
+			continue;
+		tab = strchr(line, '\t');
+		if (tab != NULL) {
+			*tab = '\0';
+			name = tab + 1;
+		} else {
+			name = strrchr(line, '/');
+			name = name != NULL ? name + 1 : line;
+		}
+		dest = name[0] == '/' ? strdup(name) : path_join(dest_dir, name);
+		batch_add(plan, line, dest);
+		free(dest);
+	}
+	free(line);
+	fclose(fp);
+}
+
+/* a later name of a hardlinked file, linked by run_plan() after the copy creates the first */
+static void plan_add_link(CopyPlan *plan, const char *target, const char *name, off_t size) {
+	if (plan->link_count % 512 == 0) {
+		plan->links = realloc(plan->links, (plan->link_count + 512) * 2 * sizeof(char *));
+		if (plan->links == NULL) {
+			perror("Failed to allocate memory for the hardlink list");
+			exit(1);
+		}
+	}
+	plan->links[plan->link_count * 2] = strdup(target);
+	plan->links[plan->link_count * 2 + 1] = strdup(name);
+	plan->link_count++;
+	plan->linked_bytes += size;
+}
+
+/* recreate source_dir under dest_dir, registering regular files in the plan */
+void tree_walk(CopyPlan *plan, LinkTable *links, const char *source_dir, const char *dest_dir, int create) {
+	struct dirent *entry;
+	struct stat st;
+	char *src, *dst, target[PATH_MAX];
+	const char *first;
+	long slot = -1;
+	ssize_t len;
+	DIR *dir;
+
+	if (stat(source_dir, &st) < 0) {
+		fprintf(stderr, "Error getting status of %s: %s\n", source_dir, strerror(errno));
+		exit(1);
+	}
+	if (create && mkdir(dest_dir, st.st_mode & 07777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Error creating directory %s: %s\n", dest_dir, strerror(errno));
+		exit(1);
+	}
+
+	dir = opendir(source_dir);
+	if (dir == NULL) {
+		fprintf(stderr, "Error opening directory %s: %s\n", source_dir, strerror(errno));
+		exit(1);
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		src = path_join(source_dir, entry->d_name);
+		dst = path_join(dest_dir, entry->d_name);
+		if (lstat(src, &st) < 0) {
+			fprintf(stderr, "Error getting status of %s: %s\n", src, strerror(errno));
+		} else if (S_ISDIR(st.st_mode)) {
+			tree_walk(plan, links, src, dst, create);
+		} else if (S_ISREG(st.st_mode) && st.st_nlink > 1 &&
+				   (slot = link_claim(links, &st, &first)) < 0 && first != NULL) {
+			plan_add_link(plan, first, dst, st.st_size);
+		} else if (S_ISREG(st.st_mode)) {
+			plan_add_file(plan, src, dst, st.st_size, st.st_mode, (off_t)st.st_blocks * 512 < st.st_size);
+			/* the destination is created by run_plan() before any link to it */
+			if (st.st_nlink > 1 && slot >= 0)
+				link_publish(links, slot, dst);
+		} else if (S_ISLNK(st.st_mode) && create) {
+			len = readlink(src, target, sizeof(target) - 1);
+			if (len >= 0) {
+				target[len] = '\0';
+				unlink(dst);
+				if (symlink(target, dst) < 0)
+					fprintf(stderr, "Error creating symlink %s: %s\n", dst, strerror(errno));
+			}
+		} else if (!S_ISLNK(st.st_mode)) {
+			fprintf(stderr, "Skipping %s, not a regular file, directory or symlink\n", src);
+		}
+		free(src);
+		free(dst);
+	}
+	closedir(dir);
+}
+
+/*
+ * throughput sampling
+ *
+ * With --sample the parent records, every interval, the bytes copied so
+ * far and the kernel's writeback state: nr_dirty, nr_writeback and the
+ * dirty thresholds from /proc/vmstat, Dirty and Writeback from
+ * /proc/meminfo, and how many workers are throttled in
+ * balance_dirty_pages() or otherwise blocked on I/O. The report shows the
+ * series and the periods in which workers were throttled.
+ */
+#define SAMPLE_MAX_PIDS	4096
+
+typedef struct {
+	double t;
+	double rate;
+	unsigned long long bytes;
+	long long nr_dirty, nr_writeback, dirty_threshold, background_threshold;
+	long long dirty_kb, writeback_kb;
+	int workers, throttled, blocked;
+} Sample;
+
+typedef struct {
+	double interval;
+	FILE *csv;
+	double start, next;
+	Sample *samples;
+	int count;
+	pid_t pids[SAMPLE_MAX_PIDS];
+	int pid_count;
+} Sampler;
+
+static long long proc_value(const char *file, const char *key) {
+	char line[256];
+	size_t len = strlen(key);
+	long long value = -1;
+	FILE *fp;
+
+	fp = fopen(file, "r");
+	if (fp == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		/* vmstat is "key value", meminfo is "Key:   value kB" */
+		if (strncmp(line, key, len) == 0 && (line[len] == ' ' || line[len] == ':')) {
+			value = strtoll(line + len + 1 + strspn(line + len + 1, " "), NULL, 10);
+			break;
+		}
+	}
+	fclose(fp);
+	return value;
+}
+
+/* 1 when the worker sleeps in balance_dirty_pages(), 2 when blocked otherwise, 0 else */
+static int worker_state(pid_t pid) {
+	char path[64], buf[4096], state = 0;
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n > 0) {
+		buf[n] = '\0';
+		if (strrchr(buf, ')') != NULL)
+			state = strrchr(buf, ')')[2];
+	}
+
+	/* wchan reads 0 when kernel addresses are hidden, the stack still names the function */
+	snprintf(path, sizeof(path), "/proc/%d/wchan", pid);
+	fd = open(path, O_RDONLY);
+	n = fd >= 0 ? read(fd, buf, sizeof(buf) - 1) : -1;
+	if (fd >= 0)
+		close(fd);
+	if (n <= 0 || strncmp(buf, "0", n) == 0) {
+		snprintf(path, sizeof(path), "/proc/%d/stack", pid);
+		fd = open(path, O_RDONLY);
+		n = fd >= 0 ? read(fd, buf, sizeof(buf) - 1) : -1;
+		if (fd >= 0)
+			close(fd);
+	}
+	if (n > 0) {
+		buf[n] = '\0';
+		if (strstr(buf, "balance_dirty_pages") != NULL)
+			return 1;
+	}
+	return state == 'D' ? 2 : 0;
+}
+
+void sampler_start(Sampler *s, double interval, const char *csv_path, double start) {
+	memset(s, 0, sizeof(*s));
+	s->interval = interval;
+	s->start = start;
+	s->next = start + interval;
+	if (csv_path != NULL) {
+		s->csv = fopen(csv_path, "w");
+		if (s->csv == NULL) {
+			perror("Error creating the sample file");
+			exit(1);
+		}
+		fprintf(s->csv, "seconds,mib_per_s,copied_mib,nr_dirty,nr_writeback,dirty_threshold,"
+				"background_threshold,dirty_kb,writeback_kb,workers,throttled,blocked\n");
+	}
+}
+
+void sampler_add_pid(Sampler *s, pid_t pid) {
+	if (s != NULL && s->pid_count < SAMPLE_MAX_PIDS)
+		s->pids[s->pid_count++] = pid;
+}
+
+/* take a sample if one is due */
+void sampler_tick(Sampler *s, const CopyStats *stats, double now) {
+	Sample *sample, *prev;
+	int i, state;
+
+	if (s == NULL || now < s->next)
+		return;
+	s->next += s->interval;
+	if (s->next <= now)
+		s->next = now + s->interval;
+
+	if (s->count % 256 == 0) {
+		s->samples = realloc(s->samples, (s->count + 256) * sizeof(Sample));
+		if (s->samples == NULL) {
+			perror("Failed to allocate memory for samples");
+			exit(1);
+		}
+	}
+	sample = &s->samples[s->count++];
+	memset(sample, 0, sizeof(*sample));
+	sample->t = now - s->start;
+	sample->bytes = __atomic_load_n(&stats->copied_bytes, __ATOMIC_RELAXED) +
+					__atomic_load_n(&stats->cloned_bytes, __ATOMIC_RELAXED);
+	prev = s->count > 1 ? &s->samples[s->count - 2] : NULL;
+	sample->rate = (sample->bytes - (prev ? prev->bytes : 0)) / (1024.0 * 1024.0) /
+				   (sample->t - (prev ? prev->t : 0.0));
+	sample->nr_dirty = proc_value("/proc/vmstat", "nr_dirty");
+	sample->nr_writeback = proc_value("/proc/vmstat", "nr_writeback");
+	sample->dirty_threshold = proc_value("/proc/vmstat", "nr_dirty_threshold");
+	sample->background_threshold = proc_value("/proc/vmstat", "nr_dirty_background_threshold");
+	sample->dirty_kb = proc_value("/proc/meminfo", "Dirty");
+	sample->writeback_kb = proc_value("/proc/meminfo", "Writeback");
+	for (i = 0; i < s->pid_count; i++) {
+		state = worker_state(s->pids[i]);
+		if (state < 0)
+			continue;
+		sample->workers++;
+		if (state == 1)
+			sample->throttled++;
+		else if (state == 2)
+			sample->blocked++;
+	}
+
+	if (s->csv != NULL)
+		fprintf(s->csv, "%.3f,%.2f,%.2f,%lld,%lld,%lld,%lld,%lld,%lld,%d,%d,%d\n", sample->t, sample->rate,
+				sample->bytes / (1024.0 * 1024.0), sample->nr_dirty, sample->nr_writeback, sample->dirty_threshold,
+				sample->background_threshold, sample->dirty_kb, sample->writeback_kb,
+				sample->workers, sample->throttled, sample->blocked);
+}
+
+void sampler_report(Sampler *s) {
+	const Sample *sample;
+	int i, from = -1, peak = 0;
+	double lost = 0.0;
+
+	printf("Time series (pages for nr_*, KiB for Dirty and Writeback):\n");
+	printf("%8s %10s %10s %10s %10s %10s %8s %10s\n", "seconds", "MiB/s", "nr_dirty", "nr_wback",
+		   "Dirty", "Writeback", "workers", "throttled");
+	for (i = 0; i < s->count; i++) {
+		sample = &s->samples[i];
+		printf("%8.2f %10.2f %10lld %10lld %10lld %10lld %8d %10d%s\n", sample->t, sample->rate, sample->nr_dirty,
+			   sample->nr_writeback, sample->dirty_kb, sample->writeback_kb, sample->workers, sample->throttled,
+			   sample->nr_dirty >= sample->background_threshold && sample->background_threshold > 0 ? " *" : "");
+	}
+	if (s->count > 0 && s->samples[0].background_threshold > 0)
+		printf("  * dirty pages above the background threshold (%lld pages), throttling limit %lld pages\n",
+			   s->samples[0].background_threshold, s->samples[0].dirty_threshold);
+
+	/* join consecutive throttled samples into periods */
+	for (i = 0; i <= s->count; i++) {
+		if (i < s->count && s->samples[i].throttled > 0) {
+			if (from < 0) {
+				from = i;
+				peak = 0;
+				lost = 0.0;
+			}
+			if (s->samples[i].throttled > peak)
+				peak = s->samples[i].throttled;
+			lost += (double)s->samples[i].throttled / s->samples[i].workers;
+			continue;
+		}
+		if (from >= 0) {
+			printf("Throttled in balance_dirty_pages: %.2f-%.2f seconds, up to %d workers, %.0f%% of worker time\n",
+				   from > 0 ? s->samples[from - 1].t : 0.0, s->samples[i - 1].t, peak, 100.0 * lost / (i - from));
+			from = -1;
+		}
+	}
+
+	if (s->csv != NULL)
+		fclose(s->csv);
+	free(s->samples);
+}
+
+/* everything a worker needs to run copy_blocks() */
+typedef struct {
+	const CopyPlan *plan;
+	double start_time;
+	const CopyEngine *engine;
+	const CopyOptions *opts;
+	CopyStats *stats;
+	/* NULL unless sampling */
+	Sampler *sampler;
+} CopyJob;
+
+pid_t spawn_worker(const CopyJob *job) {
+	pid_t pid;
+
+	/* children must not inherit and re-flush buffered output */
+	fflush(NULL);
+
+	pid = fork();
+	if (pid < 0) {
+		perror("Error forking process");
+		exit(1);
+	} else if (pid == 0) {
+		cgroup_join(&job->opts->cgroup);
+		/* child process perform the file copy with its own file descriptors */
+		copy_blocks(job->plan, job->start_time, job->engine, job->opts, job->stats);
+		/* exit the child process */
+		exit(0);
+	}
+	sampler_add_pid(job->sampler, pid);
+	return pid;
+}
+
+/*
+ * deadline-aware pacing
+ *
+ * Instead of running flat out, a copy with a deadline starts with one worker
+ * and a bandwidth budget just above the target rate, set once from the
+ * size and the time until a margin before the deadline. Every tick the
+ * supervisor tops up the shared byte budget, and once a second it adds
+ * workers when the copy falls behind the rate it now needs although no
+ * worker waited on the budget during that second. The budget only grows
+ * past the target while the copy is behind, so a copy that keeps up
+ * finishes before the margin with as few workers as that takes. Past the
+ * margin the budget is lifted and all workers start.
+ */
+#define DEADLINE_TICK_USEC	100000
+/* aim to be done when this fraction of the time until the deadline has passed */
+#define DEADLINE_MARGIN		0.9
+/* budget handed out above the required rate so stalls can be caught up */
+#define DEADLINE_SLACK		1.25
+
+int supervise_deadline(const CopyJob *job, int max_workers, off_t total_bytes) {
+	const CopyOptions *opts = job->opts;
+	CopyStats *stats = job->stats;
+	double now, last_tick, last_sample, left, required = 0.0, target = 0.0, cap = 0.0, rate;
+	double rate_peak = 0.0, cap_sum = 0.0, start = job->start_time, finish_by;
+	unsigned long long done, last_done = 0, budget, claimed;
+	int running = 0, started = 0, peak = 0, failed = 0, ticks = 0, unlimited = 0, held = 0, add, status;
+	pid_t pid;
+
+	/* start with a budget for the first tick and a single worker */
+	finish_by = start + (opts->deadline - start) * DEADLINE_MARGIN;
+	left = finish_by - start;
+	if (left > 0.0)
+		target = total_bytes / left;
+	cap = target * DEADLINE_SLACK;
+	__atomic_store_n(&stats->budget_bytes, (unsigned long long)(cap * DEADLINE_TICK_USEC / 1000000.0) + 1, __ATOMIC_RELAXED);
+	spawn_worker(job);
+	running = started = peak = 1;
+	last_tick = last_sample = start;
+
+	while (running > 0) {
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			running--;
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				failed = 1;
+		}
+		if (running == 0)
+			break;
+		usleep(DEADLINE_TICK_USEC);
+
+		now = now_seconds();
+		sampler_tick(job->sampler, stats, now);
+		done = __atomic_load_n(&stats->copied_bytes, __ATOMIC_RELAXED) + __atomic_load_n(&stats->cloned_bytes, __ATOMIC_RELAXED);
+		left = finish_by - now;
+
+		if (!unlimited && left <= DEADLINE_TICK_USEC / 1000000.0) {
+			/* out of time, run flat out */
+			unlimited = 1;
+			__atomic_store_n(&stats->budget_bytes, ~0ULL, __ATOMIC_RELAXED);
+			while (started < max_workers && __atomic_load_n(&stats->next_chunk, __ATOMIC_RELAXED) + running < job->plan->total_chunks) {
+				spawn_worker(job);
+				started++;
+				running++;
+			}
+		}
+		if (!unlimited) {
+			/* behind schedule the budget follows the rate needed to catch up */
+			required = (total_bytes - (double)done) / left;
+			cap = (required > target ? required : target) * DEADLINE_SLACK;
+			/* a worker claims before it waits, so claims past the budget mean the budget holds it back */
+			budget = __atomic_load_n(&stats->budget_bytes, __ATOMIC_RELAXED);
+			claimed = __atomic_load_n(&stats->claimed_bytes, __ATOMIC_RELAXED);
+			if (claimed > budget)
+				held = 1;
+			/* hand out budget for this tick, but never more than half a second of burst */
+			budget += (unsigned long long)(cap * (now - last_tick));
+			if (budget > claimed + (unsigned long long)(cap / 2))
+				budget = claimed + (unsigned long long)(cap / 2);
+			__atomic_store_n(&stats->budget_bytes, budget, __ATOMIC_RELAXED);
+			cap_sum += cap;
+			ticks++;
+		}
+		last_tick = now;
+
+		/* once a second decide whether the workers we have keep up */
+		if (now - last_sample >= 1.0) {
+			rate = (done - last_done) / (now - last_sample);
+			if (rate > rate_peak)
+				rate_peak = rate;
+			if (!unlimited && rate < required && !held && started < max_workers) {
+				/* assume throughput grows with workers, add as many as the shortfall suggests */
+				add = rate > 0.0 ? (int)(running * required / rate) + 1 - running : 1;
+				if (add < 1)
+					add = 1;
+				for (; add > 0 && started < max_workers; add--) {
+					spawn_worker(job);
+					started++;
+					running++;
+				}
+				printf("Behind schedule (%.2f of %.2f MiB/s needed), now %d workers.\n",
+					   rate / (1024.0 * 1024.0), required / (1024.0 * 1024.0), running);
+			}
+			last_done = done;
+			last_sample = now;
+			held = 0;
+		}
+		if (running > peak)
+			peak = running;
+	}
+
+	now = now_seconds();
+	if (now <= opts->deadline)
+		printf("Deadline met with %.2f seconds to spare.\n", opts->deadline - now);
+	else
+		printf("Deadline missed by %.2f seconds.\n", now - opts->deadline);
+	printf("Headroom: peak of %d out of %d workers", peak, max_workers);
+	if (ticks > 0)
+		printf(", average budget %.2f MiB/s", cap_sum / ticks / (1024.0 * 1024.0));
+	printf(", average %.2f MiB/s against a best second of %.2f MiB/s\n",
+		   total_bytes / (1024.0 * 1024.0) / (now - start), rate_peak / (1024.0 * 1024.0));
+	return failed;
+}
+
+/* the bytes to hint per file so a window of count files fits the memory bound */
+off_t lookahead_bytes(int count, size_t block_size) {
+	long long available = proc_value("/proc/meminfo", "MemAvailable");
+	off_t bytes = LOOKAHEAD_MEMORY;
+
+	/* never more than a sixteenth of the memory available */
+	if (available > 0 && available * 1024 / 16 < bytes)
+		bytes = available * 1024 / 16;
+	bytes /= count;
+	return bytes > (off_t)block_size ? bytes / block_size * block_size : (off_t)block_size;
+}
+
+void run_plan(CopyPlan *plan, int num_processes, const CopyEngine *engine, const CopyOptions *opts, RunResult *result) {
+	int dest_fd, status, failed = 0, i;
+	CopyStats *stats;
+	CopyJob job;
+	Sampler sampler;
+	double mean;
+
+	/* workers are processes, their counters live in a shared mapping */
+	stats = mmap(NULL, sizeof(CopyStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	plan->progress = mmap(NULL, (plan->file_count + 1) * sizeof(FileProgress), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED || plan->progress == MAP_FAILED) {
+		perror("Error mapping shared statistics");
+		exit(1);
+	}
+	/* unpaced unless a deadline hands out the budget */
+	stats->budget_bytes = ~0ULL;
+	/* a restore plan has a file per chunk of one destination, there is nothing to prepare ahead */
+	plan->lookahead = plan->file_count > 1 && !plan->dest_ready ? opts->lookahead : 0;
+	if (plan->lookahead > 0)
+		plan->prefetch_bytes = lookahead_bytes(plan->lookahead, plan->block_size);
+
+	/* parent process: ensure the destination files are created if they don't exist */
+	for (i = 0; i < plan->file_count && !plan->dest_ready; i++) {
+		dest_fd = open(plan->files[i].dest, O_WRONLY | O_CREAT | O_TRUNC, plan->files[i].mode);
+		if (dest_fd < 0) {
+			fprintf(stderr, "Error creating destination file %s: %s\n", plan->files[i].dest, strerror(errno));
+			exit(1);
+		}
+		/* holes the plan skips, including a trailing one, stay holes */
+		if (plan->files[i].sparse && ftruncate(dest_fd, plan->files[i].size) < 0) {
+			fprintf(stderr, "Error sizing destination file %s: %s\n", plan->files[i].dest, strerror(errno));
+			exit(1);
+		}
+		/* parent closes the file; child processes will reopen it */
+		close(dest_fd);
+	}
+	/* later names of hardlinked files, their targets exist now */
+	for (i = 0; i < plan->link_count; i++) {
+		unlink(plan->links[i * 2 + 1]);
+		if (link(plan->links[i * 2], plan->links[i * 2 + 1]) < 0) {
+			fprintf(stderr, "Error linking %s to %s: %s\n", plan->links[i * 2 + 1], plan->links[i * 2], strerror(errno));
+			exit(1);
+		}
+	}
+
+	struct timeval start_time, end_time;
+	gettimeofday(&start_time, NULL);
+
+	job.plan = plan;
+	job.start_time = start_time.tv_sec + start_time.tv_usec / 1000000.0;
+	if (opts->record_file != NULL)
+		trace_create(opts->record_file, plan, num_processes, engine, job.start_time);
+	job.engine = engine;
+	job.opts = opts;
+	job.stats = stats;
+	job.sampler = NULL;
+	if (opts->sample_interval > 0.0) {
+		sampler_start(&sampler, opts->sample_interval, opts->sample_csv, job.start_time);
+		job.sampler = &sampler;
+	}
+
+	if (opts->deadline > 0.0) {
+		failed = supervise_deadline(&job, num_processes, plan->total_bytes);
+	} else {
+		/* fork processes to zero-copy the file in parallel */
+		for (i = 0; i < num_processes; i++)
+			spawn_worker(&job);
+
+		/* parent process waits for all child processes, sampling in between if asked to */
+		for (i = 0; i < num_processes; ) {
+			pid_t pid = waitpid(-1, &status, job.sampler != NULL ? WNOHANG : 0);
+			if (pid == 0) {
+				usleep(10000);
+				sampler_tick(job.sampler, stats, now_seconds());
+				continue;
+			}
+			if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				failed = 1;
+			if (pid < 0)
+				break;
+			i++;
+		}
+	}
+
+	gettimeofday(&end_time, NULL);
+	result->num_processes = num_processes;
+	result->block_size = plan->block_size;
+	result->engine = engine;
+	result->failed = failed;
+	result->elapsed_time = (end_time.tv_sec - start_time.tv_sec) + 
+						   (end_time.tv_usec - start_time.tv_usec) / 1000000.0;
+
+	if (failed) {
+		fprintf(stderr, "Copy with the %s engine failed.\n", engine->name);
+		goto out;
+	}
+
+	/* holes are skipped, not copied, so they do not count towards the rate */
+	result->throughput = (double)(plan->total_bytes - plan->hole_bytes) / (1024.0 * 1024.0 * result->elapsed_time);
+	printf("Operation completed in %.2f seconds.\n", result->elapsed_time);
+	printf("Throughput: %.2f MiB/s\n", result->throughput);
+	if (plan->hole_bytes > 0)
+		printf("Sparse: %.2f MiB of holes skipped\n", plan->hole_bytes / (1024.0 * 1024.0));
+	if (plan->link_count > 0)
+		printf("Hardlinks: %d names linked, %.2f MiB not copied again\n", plan->link_count,
+			   plan->linked_bytes / (1024.0 * 1024.0));
+	if (stats->prefetched_files > 0)
+		printf("Lookahead: %llu files prepared ahead, %.2f MiB hinted\n", stats->prefetched_files,
+			   stats->prefetched_bytes / (1024.0 * 1024.0));
+	if (opts->reference_file != NULL) {
+		printf("Reference: %llu chunks (%.2f MiB) cloned, %llu chunks (%.2f MiB) copied\n",
+			   stats->cloned_chunks, stats->cloned_bytes / (1024.0 * 1024.0),
+			   stats->copied_chunks, stats->copied_bytes / (1024.0 * 1024.0));
+	}
+	if (plan->file_count > 1 && !plan->dest_ready) {
+		/* empty files are complete as soon as they are created */
+		mean = 0.0;
+		for (i = 0; i < plan->file_count; i++)
+			mean += plan->progress[i].done_at;
+		mean /= plan->file_count;
+		printf("Files: %d, %.2f MiB, mean completion %.2f seconds, makespan %.2f seconds\n", plan->file_count,
+			   plan->total_bytes / (1024.0 * 1024.0), mean, result->elapsed_time);
+	}
+
+out:
+	if (job.sampler != NULL)
+		sampler_report(job.sampler);
+	munmap(stats, sizeof(CopyStats));
+	munmap(plan->progress, (plan->file_count + 1) * sizeof(FileProgress));
+	plan->progress = NULL;
+}
+
+void perform_copy(int num_processes, size_t block_size, const CopyEngine *engine, const char *source_file, const char *dest_file, const CopyOptions *opts, RunResult *result) {
+	struct stat file_stat;
+	CopyPlan plan;
+
+	if (stat(source_file, &file_stat) < 0) {
+		perror("Error getting file status");
+		exit(1);
+	}
+	plan_build(&plan, source_file, dest_file, &file_stat, block_size, opts->priority_spec);
+	if (plan.priority_chunks > 0)
+		printf("Copying %.2f MiB of priority ranges first.\n", plan.priority_bytes / (1024.0 * 1024.0));
+
+	run_plan(&plan, num_processes, engine, opts, result);
+	plan_free(&plan);
+}
+
+/*
+ * streaming tree mode
+ *
+ * A tree of tens of millions of entries cannot be listed up front, so in
+ * the given order tree mode streams: walker processes read directories
+ * with getdents64 and hand work to the copy workers through two pipes of
+ * fixed-size records, no larger than PIPE_BUF so every write is atomic
+ * among many writers. Directories found are queued for any walker while
+ * the directory queue has room and kept on the finding walker's own list
+ * when it is full, so the walkers never block on each other. Files are
+ * queued as pieces for the copy workers, who block on the walkers only
+ * while the queue is empty. Memory use is bounded by the pipe sizes and
+ * the directories on those lists, not the files of the tree. A shared
+ * count of directories queued, listed or being walked tells the walker
+ * that takes it to zero that the walk is over. Errors are counted rather
+ * than fatal so the rest of the tree is still copied, and a walker that
+ * dies takes the whole copy down, since the count it held never reaches
+ * zero.
+ *
+ * For trees of many tiny files the per-file overhead dominates, so with
+ * --small-files SIZE the walker queues files up to SIZE by name only,
+ * --metadata-batch of them per record, and a copy worker copies each one
+ * whole with a single read and write, without engine setup or probing
+ * for holes.
+ */
+#define STREAM_DIR	1
+#define STREAM_FILE	2
+#define STREAM_STOP	3
+/* NUL separated names of small files in path, their count in length */
+#define STREAM_BATCH	4
+/* records each queue holds */
+#define STREAM_QUEUE	256
+/* files are copied in pieces of up to this many bytes, rounded to the block size */
+#define STREAM_PIECE	(64 * 1024 * 1024)
+
+typedef struct {
+	off_t offset;
+	off_t length;
+	off_t size;
+	uint32_t kind;
+	uint32_t sparse;
+	/* relative to the source and the destination directory */
+	char path[PIPE_BUF - 3 * sizeof(off_t) - 2 * sizeof(uint32_t)];
+} StreamRecord;
+
+typedef struct {
+	/* directories queued or being walked */
+	long long pending;
+	unsigned long long dirs;
+	unsigned long long files;
+	unsigned long long queued_bytes;
+	/* files a copy worker has started on, the lookahead window is files - files_started */
+	unsigned long long files_started;
+	unsigned long long prefetched_files;
+	unsigned long long prefetched_bytes;
+	/* microseconds from the start until a copy worker took the first piece */
+	unsigned long long first_byte_usec;
+	/* walker stat, create, mkdir and symlink calls and the time spent in them */
+	unsigned long long meta_ops;
+	unsigned long long meta_nsec;
+	unsigned long long small_files;
+	unsigned long long batches;
+	/* entries that could not be read or created */
+	unsigned long long errors;
+} StreamStats;
+
+typedef struct {
+	const char *source_dir, *dest_dir;
+	size_t piece;
+	int walkers;
+	int dir_queue[2], file_queue[2];
+	StreamStats *stream;
+	CopyStats *stats;
+	LinkTable *links;
+	int lookahead;
+	off_t prefetch_bytes;
+	off_t small_file;
+	int metadata_batch;
+} StreamJob;
+
+struct linux_dirent64 {
+	ino64_t d_ino;
+	off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+static void stream_send(int fd, const StreamRecord *rec) {
+	ssize_t n;
+
+	while ((n = write(fd, rec, sizeof(*rec))) < 0 && errno == EINTR)
+		;
+	if (n != sizeof(*rec)) {
+		perror("Error queueing work");
+		exit(1);
+	}
+}
+
+/* small files a walker has named but not queued yet, each walker is a process of its own */
+static StreamRecord stream_pending = { .kind = STREAM_BATCH };
+static size_t stream_pending_fill;
+
+static void stream_flush(const StreamJob *job) {
+	if (stream_pending.length == 0)
+		return;
+	stream_send(job->file_queue[1], &stream_pending);
+	stat_add(job->stream->batches, 1);
+	stream_pending.length = 0;
+	stream_pending.size = 0;
+	stream_pending_fill = 0;
+}
+
+static void stream_small(const StreamJob *job, const char *rel, off_t size) {
+	size_t len = strlen(rel) + 1;
+
+	if (stream_pending_fill + len > sizeof(stream_pending.path))
+		stream_flush(job);
+	memcpy(stream_pending.path + stream_pending_fill, rel, len);
+	stream_pending_fill += len;
+	stream_pending.length++;
+	stream_pending.size += size;
+	if (stream_pending.length >= job->metadata_batch)
+		stream_flush(job);
+}
+
+/* account a walker metadata call that started at t */
+static void stream_meta(const StreamJob *job, double t) {
+	stat_add(job->stream->meta_ops, 1);
+	stat_add(job->stream->meta_nsec, (unsigned long long)((now_seconds() - t) * 1e9));
+}
+
+static void stream_file(const StreamJob *job, const char *rel, const struct stat *st) {
+	StreamRecord rec = { .kind = STREAM_FILE };
+	char dest[PATH_MAX];
+	const char *first;
+	long slot = -1;
+	double t;
+	int fd;
+
+	snprintf(dest, sizeof(dest), "%s/%s", job->dest_dir, rel);
+	/* a name of an inode copied already only needs a link */
+	if (st->st_nlink > 1 && (slot = link_claim(job->links, st, &first)) < 0 && first != NULL &&
+		link_name(job->links, first, dest, st->st_size) == 0)
+		return;
+
+	/* the walker creates and sizes the file, copy workers only fill it in */
+	t = now_seconds();
+	fd = open(dest, O_WRONLY | O_CREAT | O_TRUNC, st->st_mode & 07777);
+	if (fd >= 0 && ftruncate(fd, st->st_size) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	stream_meta(job, t);
+	if (fd < 0) {
+		fprintf(stderr, "Error creating destination file %s: %s\n", dest, strerror(errno));
+		stat_add(job->stream->errors, 1);
+		/* later names then fail to link and are copied on their own */
+		if (slot >= 0)
+			link_publish(job->links, slot, dest);
+		return;
+	}
+	close(fd);
+	if (slot >= 0)
+		link_publish(job->links, slot, dest);
+
+	/* prepare the file while it waits in the queue, if it is within the window */
+	if (job->lookahead > 0 && __atomic_load_n(&job->stream->files, __ATOMIC_RELAXED) -
+		__atomic_load_n(&job->stream->files_started, __ATOMIC_RELAXED) <= (unsigned long long)job->lookahead) {
+		char source[PATH_MAX];
+
+		snprintf(source, sizeof(source), "%s/%s", job->source_dir, rel);
+		stat_add(job->stream->prefetched_bytes, prefetch_file(source, dest, st->st_size,
+															 (off_t)st->st_blocks * 512 < st->st_size, job->prefetch_bytes));
+		stat_add(job->stream->prefetched_files, 1);
+	}
+
+	stat_add(job->stream->files, 1);
+	stat_add(job->stream->queued_bytes, st->st_size);
+	if (st->st_size > 0 && st->st_size <= job->small_file) {
+		stream_small(job, rel, st->st_size);
+		return;
+	}
+	strcpy(rec.path, rel);
+	rec.size = st->st_size;
+	rec.sparse = (off_t)st->st_blocks * 512 < st->st_size;
+	for (rec.offset = 0; rec.offset < st->st_size; rec.offset += rec.length) {
+		rec.length = st->st_size - rec.offset < (off_t)job->piece ? st->st_size - rec.offset : (off_t)job->piece;
+		stream_send(job->file_queue[1], &rec);
+	}
+}
+
+/* directories a walker found while the directory queue was full */
+static char **stream_local;
+static size_t stream_local_count, stream_local_size;
+
+static void stream_defer(const char *rel) {
+	if (stream_local_count == stream_local_size) {
+		stream_local_size = stream_local_size ? stream_local_size * 2 : 64;
+		stream_local = realloc(stream_local, stream_local_size * sizeof(char *));
+	}
+	if (stream_local == NULL || (stream_local[stream_local_count++] = strdup(rel)) == NULL) {
+		perror("Error allocating the directory list");
+		exit(1);
+	}
+}
+
+static void stream_walk(const StreamJob *job, const char *rel) {
+	char buf[8192], path[PATH_MAX], dest[PATH_MAX], sub[sizeof(((StreamRecord *)0)->path)], target[PATH_MAX];
+	StreamRecord rec = { .kind = STREAM_DIR };
+	struct linux_dirent64 *d;
+	struct stat st;
+	long n, pos;
+	ssize_t len;
+	double t;
+	int fd, err;
+
+	snprintf(path, sizeof(path), "%s/%s", job->source_dir, rel);
+	fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		fprintf(stderr, "Error opening directory %s: %s\n", path, strerror(errno));
+		stat_add(job->stream->errors, 1);
+		return;
+	}
+	stat_add(job->stream->dirs, 1);
+
+	while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		for (pos = 0; pos < n; pos += d->d_reclen) {
+			d = (struct linux_dirent64 *)(buf + pos);
+			if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+				continue;
+			if ((size_t)snprintf(sub, sizeof(sub), "%s%s%s", rel, rel[0] ? "/" : "", d->d_name) >= sizeof(sub)) {
+				fprintf(stderr, "Skipping %s/%s, path too long\n", path, d->d_name);
+				stat_add(job->stream->errors, 1);
+				continue;
+			}
+			t = now_seconds();
+			err = fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW);
+			stream_meta(job, t);
+			if (err < 0) {
+				fprintf(stderr, "Error getting status of %s/%s: %s\n", path, d->d_name, strerror(errno));
+				stat_add(job->stream->errors, 1);
+				continue;
+			}
+
+			if (S_ISREG(st.st_mode)) {
+				stream_file(job, sub, &st);
+			} else if (S_ISDIR(st.st_mode)) {
+				snprintf(dest, sizeof(dest), "%s/%s", job->dest_dir, sub);
+				t = now_seconds();
+				err = mkdir(dest, st.st_mode & 07777) < 0 && errno != EEXIST;
+				stream_meta(job, t);
+				if (err) {
+					fprintf(stderr, "Error creating directory %s: %s\n", dest, strerror(errno));
+					stat_add(job->stream->errors, 1);
+					continue;
+				}
+				/* hand the directory to any walker, or keep it for later here if the queue is full */
+				__atomic_add_fetch(&job->stream->pending, 1, __ATOMIC_ACQ_REL);
+				strcpy(rec.path, sub);
+				if (write(job->dir_queue[1], &rec, sizeof(rec)) != sizeof(rec))
+					stream_defer(sub);
+			} else if (S_ISLNK(st.st_mode)) {
+				t = now_seconds();
+				len = readlinkat(fd, d->d_name, target, sizeof(target) - 1);
+				if (len >= 0) {
+					target[len] = '\0';
+					snprintf(dest, sizeof(dest), "%s/%s", job->dest_dir, sub);
+					unlink(dest);
+					if (symlink(target, dest) < 0) {
+						fprintf(stderr, "Error creating symlink %s: %s\n", dest, strerror(errno));
+						stat_add(job->stream->errors, 1);
+					}
+				} else {
+					fprintf(stderr, "Error reading symlink %s/%s: %s\n", path, d->d_name, strerror(errno));
+					stat_add(job->stream->errors, 1);
+				}
+				stream_meta(job, t);
+			} else {
+				fprintf(stderr, "Skipping %s/%s, not a regular file, directory or symlink\n", path, d->d_name);
+			}
+		}
+	}
+	if (n < 0) {
+		fprintf(stderr, "Error reading directory %s: %s\n", path, strerror(errno));
+		stat_add(job->stream->errors, 1);
+	}
+	close(fd);
+}
+
+/* a directory is walked, the walk is over when nothing is queued, listed or being walked */
+static void stream_walked(const StreamJob *job) {
+	StreamRecord rec = { .kind = STREAM_STOP };
+	int i, queued;
+
+	/* do not hold small files back while waiting for the next directory */
+	if (stream_local_count == 0 && ioctl(job->dir_queue[0], FIONREAD, &queued) == 0 && queued == 0)
+		stream_flush(job);
+	if (__atomic_sub_fetch(&job->stream->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+		/* wake all walkers */
+		for (i = 0; i < job->walkers; i++) {
+			while (write(job->dir_queue[1], &rec, sizeof(rec)) != sizeof(rec))
+				usleep(1000);
+		}
+	}
+}
+
+static void stream_walker(const StreamJob *job) {
+	StreamRecord rec;
+	char *rel;
+	ssize_t n;
+
+	close(job->file_queue[0]);
+	while ((n = read(job->dir_queue[0], &rec, sizeof(rec))) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n != sizeof(rec)) {
+			perror("Error reading the directory queue");
+			exit(1);
+		}
+		if (rec.kind == STREAM_STOP)
+			break;
+		stream_walk(job, rec.path);
+		stream_walked(job);
+		/* then the directories the queue had no room for, deepest first */
+		while (stream_local_count > 0) {
+			rel = stream_local[--stream_local_count];
+			stream_walk(job, rel);
+			free(rel);
+			stream_walked(job);
+		}
+	}
+	stream_flush(job);
+}
+
+/* copy the part of a piece that holds data, holes stay holes */
+static int stream_copy(const CopyEngine *engine, EngineCtx *ctx, const StreamRecord *rec, CopyStats *stats) {
+	off_t pos = rec->offset, end = rec->offset + rec->length, data, hole, off;
+	size_t len;
+
+	while (pos < end) {
+		data = hole = end;
+		if (rec->sparse) {
+			data = lseek(ctx->source_fd, pos, SEEK_DATA);
+			if (data < 0)
+				data = errno == ENXIO ? end : pos;
+			if (data > end)
+				data = end;
+			hole = data < end ? lseek(ctx->source_fd, data, SEEK_HOLE) : end;
+			if (hole < 0 || hole > end)
+				hole = end;
+		} else {
+			data = pos;
+		}
+		for (off = data; off < hole; off += len) {
+			len = hole - off < (off_t)ctx->block_size ? (size_t)(hole - off) : ctx->block_size;
+			if (engine_copy_full(engine, ctx, off, off, len) < 0)
+				return -1;
+			stat_add(stats->copied_chunks, 1);
+			stat_add(stats->copied_bytes, len);
+		}
+		pos = hole;
+	}
+	return 0;
+}
+
+/* copy each small file named in the record whole through buf */
+static int stream_copy_small(const StreamJob *job, const StreamRecord *rec, char *buf) {
+	const char *name = rec->path;
+	char path[PATH_MAX];
+	int source_fd, dest_fd;
+	off_t i, done;
+	ssize_t n = 0;
+
+	for (i = 0; i < rec->length; i++, name += strlen(name) + 1) {
+		stat_add(job->stream->files_started, 1);
+		snprintf(path, sizeof(path), "%s/%s", job->source_dir, name);
+		source_fd = open(path, O_RDONLY);
+		snprintf(path, sizeof(path), "%s/%s", job->dest_dir, name);
+		dest_fd = open(path, O_WRONLY);
+		for (done = 0; source_fd >= 0 && dest_fd >= 0 && (n = read(source_fd, buf, job->small_file)) > 0; done += n) {
+			if (write_full(dest_fd, (unsigned char *)buf, n, done) < 0) {
+				n = -1;
+				break;
+			}
+		}
+		if (source_fd < 0 || dest_fd < 0 || n < 0) {
+			fprintf(stderr, "Error copying %s: %s\n", name, strerror(errno));
+			return -1;
+		}
+		close(source_fd);
+		close(dest_fd);
+		stat_add(job->stats->copied_chunks, 1);
+		stat_add(job->stats->copied_bytes, done);
+		stat_add(job->stream->small_files, 1);
+	}
+	return 0;
+}
+
+static void stream_copier(const StreamJob *job, size_t block_size, const CopyEngine *engine, double start_time) {
+	EngineCtx ctx = { .source_fd = -1, .dest_fd = -1, .block_size = block_size, .pipe_fd = { -1, -1 } };
+	char path[PATH_MAX];
+	unsigned long long expected, at;
+	char *buf = NULL;
+	StreamRecord rec;
+	ssize_t n;
+
+	close(job->dir_queue[0]);
+	close(job->dir_queue[1]);
+	close(job->file_queue[1]);
+	if (job->small_file > 0 && (buf = malloc(job->small_file)) == NULL) {
+		perror("Error allocating the small file buffer");
+		exit(1);
+	}
+	if (engine->init(&ctx) < 0) {
+		fprintf(stderr, "Error initializing %s engine: %s\n", engine->name, strerror(errno));
+		exit(1);
+	}
+
+	while ((n = read(job->file_queue[0], &rec, sizeof(rec))) != 0) {
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n != sizeof(rec)) {
+			perror("Error reading the file queue");
+			exit(1);
+		}
+		expected = 0;
+		at = (now_seconds() - start_time) * 1000000.0 + 1;
+		__atomic_compare_exchange_n(&job->stream->first_byte_usec, &expected, at, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		if (rec.kind == STREAM_BATCH) {
+			if (stream_copy_small(job, &rec, buf) < 0)
+				exit(1);
+			continue;
+		}
+		if (rec.offset == 0)
+			stat_add(job->stream->files_started, 1);
+
+		snprintf(path, sizeof(path), "%s/%s", job->source_dir, rec.path);
+		ctx.source_fd = open(path, O_RDONLY);
+		snprintf(path, sizeof(path), "%s/%s", job->dest_dir, rec.path);
+		ctx.dest_fd = open(path, O_WRONLY);
+		if (ctx.source_fd < 0 || ctx.dest_fd < 0 || stream_copy(engine, &ctx, &rec, job->stats) < 0 || engine->flush(&ctx) < 0) {
+			fprintf(stderr, "Error copying %s: %s\n", rec.path, strerror(errno));
+			exit(1);
+		}
+		close(ctx.source_fd);
+		close(ctx.dest_fd);
+	}
+	engine->teardown(&ctx);
+	free(buf);
+}
+
+void stream_tree(int num_processes, size_t block_size, const CopyEngine *engine, const char *source_dir, const char *dest_dir, LinkTable *links, const CopyOptions *opts, RunResult *result) {
+	StreamRecord rec = { .kind = STREAM_DIR };
+	int status, failed = 0, i, j, children;
+	double start, elapsed;
+	Sampler sampler, *samp = NULL;
+	StreamJob job;
+	struct stat st;
+	pid_t pid, *pids;
+
+	if (stat(source_dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+		fprintf(stderr, "%s is not a directory.\n", source_dir);
+		exit(1);
+	}
+	if (mkdir(dest_dir, st.st_mode & 07777) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Error creating directory %s: %s\n", dest_dir, strerror(errno));
+		exit(1);
+	}
+
+	job.source_dir = source_dir;
+	job.dest_dir = dest_dir;
+	job.links = links;
+	job.lookahead = opts->lookahead;
+	job.prefetch_bytes = opts->lookahead > 0 ? lookahead_bytes(opts->lookahead, block_size) : 0;
+	job.small_file = opts->small_file;
+	job.metadata_batch = opts->metadata_batch > 0 ? opts->metadata_batch : 1;
+	job.piece = STREAM_PIECE / block_size * block_size;
+	if (job.piece == 0)
+		job.piece = block_size;
+	/* walking is metadata bound, a quarter of the workers keep the copiers fed */
+	job.walkers = num_processes / 4 > 0 ? num_processes / 4 : 1;
+	job.stream = mmap(NULL, sizeof(StreamStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	job.stats = mmap(NULL, sizeof(CopyStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (job.stream == MAP_FAILED || job.stats == MAP_FAILED || pipe(job.dir_queue) < 0 || pipe(job.file_queue) < 0) {
+		perror("Error setting up the work queues");
+		exit(1);
+	}
+	fcntl(job.dir_queue[1], F_SETPIPE_SZ, STREAM_QUEUE * (int)sizeof(StreamRecord));
+	fcntl(job.file_queue[1], F_SETPIPE_SZ, STREAM_QUEUE * (int)sizeof(StreamRecord));
+	/* a walker that finds the directory queue full walks the directory itself */
+	fcntl(job.dir_queue[1], F_SETFL, O_NONBLOCK);
+
+	job.stream->pending = 1;
+	rec.path[0] = '\0';
+	stream_send(job.dir_queue[1], &rec);
+
+	start = now_seconds();
+	if (opts->sample_interval > 0.0) {
+		sampler_start(&sampler, opts->sample_interval, opts->sample_csv, start);
+		samp = &sampler;
+	}
+	fflush(NULL);
+	children = job.walkers + num_processes;
+	pids = calloc(children, sizeof(pid_t));
+	if (pids == NULL) {
+		perror("Error allocating the worker list");
+		exit(1);
+	}
+	for (i = 0; i < children; i++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("Error forking process");
+			exit(1);
+		} else if (pid == 0) {
+			cgroup_join(&opts->cgroup);
+			if (i < job.walkers)
+				stream_walker(&job);
+			else
+				stream_copier(&job, block_size, engine, start);
+			exit(0);
+		}
+		pids[i] = pid;
+		sampler_add_pid(samp, pid);
+	}
+	close(job.dir_queue[0]);
+	close(job.dir_queue[1]);
+	close(job.file_queue[0]);
+	close(job.file_queue[1]);
+
+	for (i = 0; i < children; ) {
+		pid = waitpid(-1, &status, samp != NULL ? WNOHANG : 0);
+		if (pid == 0) {
+			usleep(10000);
+			sampler_tick(samp, job.stats, now_seconds());
+			continue;
+		}
+		if (pid < 0)
+			break;
+		for (j = 0; j < children && pids[j] != pid; j++)
+			;
+		if (j < children)
+			pids[j] = 0;
+		/* the others would wait for the dead worker's directories or files forever */
+		if ((!WIFEXITED(status) || WEXITSTATUS(status) != 0) && !failed) {
+			failed = 1;
+			for (j = 0; j < children; j++)
+				if (pids[j] > 0)
+					kill(pids[j], SIGKILL);
+		}
+		i++;
+	}
+	elapsed = now_seconds() - start;
+	free(pids);
+
+	result->num_processes = num_processes;
+	result->block_size = block_size;
+	result->engine = engine;
+	result->failed = failed;
+	result->elapsed_time = elapsed;
+	result->files = job.stream->files;
+	result->files_per_sec = job.stream->files / elapsed;
+	result->meta_latency = job.stream->meta_ops > 0 ? job.stream->meta_nsec / 1e9 / job.stream->meta_ops : 0.0;
+	if (failed) {
+		fprintf(stderr, "Copy with the %s engine failed.\n", engine->name);
+	} else {
+		result->throughput = job.stats->copied_bytes / (1024.0 * 1024.0) / elapsed;
+		printf("Operation completed in %.2f seconds.\n", elapsed);
+		printf("Throughput: %.2f MiB/s\n", result->throughput);
+		printf("Streamed %llu directories and %llu files (%.2f MiB) with %d walkers, first byte after %.1f ms\n",
+			   job.stream->dirs, job.stream->files, job.stream->queued_bytes / (1024.0 * 1024.0), job.walkers,
+			   job.stream->first_byte_usec / 1000.0);
+		printf("Files: %.0f files/s, %llu metadata calls by the walkers taking %.1f us on average\n",
+			   result->files_per_sec, job.stream->meta_ops, result->meta_latency * 1e6);
+		if (job.stream->small_files > 0)
+			printf("Small files: %llu copied whole in %llu batches\n", job.stream->small_files, job.stream->batches);
+		if (job.stream->prefetched_files > 0)
+			printf("Lookahead: %llu files prepared ahead, %.2f MiB hinted\n", job.stream->prefetched_files,
+				   job.stream->prefetched_bytes / (1024.0 * 1024.0));
+		if (*links->linked_names > 0)
+			printf("Hardlinks: %llu names linked, %.2f MiB not copied again\n", *links->linked_names,
+				   *links->linked_bytes / (1024.0 * 1024.0));
+		if (job.stats->copied_bytes < job.stream->queued_bytes)
+			printf("Sparse: %.2f MiB of holes skipped\n",
+				   (job.stream->queued_bytes - job.stats->copied_bytes) / (1024.0 * 1024.0));
+		if (job.stream->errors > 0) {
+			fprintf(stderr, "%llu entries could not be copied, see above.\n", job.stream->errors);
+			result->failed = 1;
+		}
+	}
+	if (samp != NULL)
+		sampler_report(samp);
+	munmap(job.stream, sizeof(StreamStats));
+	munmap(job.stats, sizeof(CopyStats));
+}
+
+/*
+ * content-addressed chunk store
+ *
+ * --store splits the source into chunks, fixed size or content defined
+ * (--cdc), and keeps each distinct chunk once in a directory under its
+ * SHA-256: DIR/ab/cdef... A text recipe lists the chunks that make up the
+ * file, so storing a new version of a file only writes the chunks that
+ * changed. Workers claim regions of the source from the usual plan, hash
+ * and store their chunks and send the recipe entries to the parent over a
+ * pipe. --restore turns a recipe back into a chunk plan and copies the
+ * chunk files into place with the copy engines.
+ */
+#define STORE_REGION	(16 * 1024 * 1024)
+
+typedef struct {
+	uint32_t h[8];
+	uint64_t length;
+	unsigned char buf[64];
+	size_t fill;
+} Sha256;
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ror32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(Sha256 *s, const unsigned char *p) {
+	uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t)p[i * 4] << 24 | (uint32_t)p[i * 4 + 1] << 16 | (uint32_t)p[i * 4 + 2] << 8 | p[i * 4 + 3];
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + (ror32(w[i - 15], 7) ^ ror32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+			   w[i - 7] + (ror32(w[i - 2], 17) ^ ror32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+	a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+	e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+	for (i = 0; i < 64; i++) {
+		t1 = h + (ror32(e, 6) ^ ror32(e, 11) ^ ror32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+		t2 = (ror32(a, 2) ^ ror32(a, 13) ^ ror32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+	s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+static void sha256_init(Sha256 *s) {
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(s->h, iv, sizeof(iv));
+	s->length = 0;
+	s->fill = 0;
+}
+
+static void sha256_update(Sha256 *s, const unsigned char *p, size_t len) {
+	size_t n;
+
+	s->length += len;
+	if (s->fill > 0) {
+		n = 64 - s->fill < len ? 64 - s->fill : len;
+		memcpy(s->buf + s->fill, p, n);
+		s->fill += n;
+		p += n;
+		len -= n;
+		if (s->fill < 64)
+			return;
+		sha256_block(s, s->buf);
+		s->fill = 0;
+	}
+	for (; len >= 64; p += 64, len -= 64)
+		sha256_block(s, p);
+	memcpy(s->buf, p, len);
+	s->fill = len;
+}
+
+static void sha256_final(Sha256 *s, unsigned char digest[32]) {
+	uint64_t bits = s->length * 8;
+	unsigned char pad[72] = { 0x80 };
+	size_t n = (s->fill < 56 ? 56 : 120) - s->fill;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		pad[n + i] = bits >> (56 - i * 8);
+	sha256_update(s, pad, n + 8);
+	for (i = 0; i < 32; i++)
+		digest[i] = s->h[i / 4] >> (24 - (i % 4) * 8);
+}
+
+static void digest_hex(const unsigned char digest[32], char hex[65]) {
+	for (int i = 0; i < 32; i++)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+}
+
+/*
+ * gear hash chunking (FastCDC): a cut point is where the rolling hash has
+ * the mask's bits clear, with a stricter mask before the average size and
+ * a looser one after it, so chunk sizes cluster around avg
+ */
+static uint64_t gear[256];
+
+static void gear_init(void) {
+	/* splitmix64, the table must be the same on every run */
+	uint64_t x = 0x647a6370;
+
+	for (int i = 0; i < 256; i++) {
+		uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = z ^ (z >> 31);
+	}
+}
+
+static size_t cdc_cut(const unsigned char *p, size_t len, size_t avg) {
+	size_t min = avg / 4, max = avg * 4, i;
+	uint64_t hash = 0, mask_small, mask_large;
+	int bits = 0;
+
+	if (len <= min)
+		return len;
+	if (len > max)
+		len = max;
+	while (((size_t)1 << (bits + 1)) <= avg)
+		bits++;
+	/* the hash shifts left, so its high bits have seen the most bytes */
+	mask_small = ~0ULL << (64 - bits - 1);
+	mask_large = ~0ULL << (64 - bits + 1);
+
+	for (i = min; i < len && i < avg; i++) {
+		hash = (hash << 1) + gear[p[i]];
+		if (!(hash & mask_small))
+			return i + 1;
+	}
+	for (; i < len; i++) {
+		hash = (hash << 1) + gear[p[i]];
+		if (!(hash & mask_large))
+			return i + 1;
+	}
+	return len;
+}
+
+/* one recipe entry, written to the parent in a single atomic pipe write */
+typedef struct {
+	off_t offset;
+	uint32_t length;
+	unsigned char digest[32];
+} StoreRecord;
+
+typedef struct {
+	unsigned long long next_chunk;
+	unsigned long long stored_chunks;
+	unsigned long long stored_bytes;
+	unsigned long long duplicate_chunks;
+	unsigned long long duplicate_bytes;
+} StoreStats;
+
+static void store_chunk_path(const char *store, const unsigned char digest[32], char *path, size_t size) {
+	char hex[65];
+
+	digest_hex(digest, hex);
+	snprintf(path, size, "%s/%.2s/%s", store, hex, hex + 2);
+}
+
+/* returns 1 if the chunk was new, 0 if the store already had it */
+static int store_chunk(const char *store, const unsigned char digest[32], const unsigned char *data, size_t len) {
+	char path[PATH_MAX], tmp[PATH_MAX + 32], *slash;
+	size_t done = 0;
+	ssize_t n;
+	int fd, rc;
+
+	store_chunk_path(store, digest, path, sizeof(path));
+	if (access(path, F_OK) == 0)
+		return 0;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0444);
+	if (fd < 0 && errno == ENOENT) {
+		slash = strrchr(tmp, '/');
+		*slash = '\0';
+		if (mkdir(tmp, 0755) < 0 && errno != EEXIST) {
+			fprintf(stderr, "Error creating store directory %s: %s\n", tmp, strerror(errno));
+			exit(1);
+		}
+		*slash = '/';
+		fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0444);
+	}
+	if (fd < 0) {
+		fprintf(stderr, "Error creating chunk %s: %s\n", tmp, strerror(errno));
+		exit(1);
+	}
+	while (done < len) {
+		n = write(fd, data + done, len - done);
+		if (n < 0) {
+			fprintf(stderr, "Error writing chunk %s: %s\n", tmp, strerror(errno));
+			exit(1);
+		}
+		done += n;
+	}
+	close(fd);
+
+	/* link() never replaces, a worker that stored the same chunk first wins */
+	rc = link(tmp, path);
+	if (rc < 0 && errno != EEXIST) {
+		fprintf(stderr, "Error adding chunk %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	unlink(tmp);
+	return rc < 0 ? 0 : 1;
+}
+
+static void store_worker(const CopyPlan *plan, const char *store, int cdc, size_t avg, StoreStats *stats, int out) {
+	unsigned long long chunk;
+	unsigned char *buf;
+	StoreRecord rec;
+	Sha256 sha;
+	off_t offset;
+	size_t len, pos, cut;
+	int fd;
+
+	buf = malloc(plan->block_size);
+	fd = open(plan->files[0].source, O_RDONLY);
+	if (buf == NULL || fd < 0) {
+		perror("Error preparing store worker");
+		exit(1);
+	}
+
+	while ((chunk = __atomic_fetch_add(&stats->next_chunk, 1, __ATOMIC_RELAXED)) < plan->total_chunks) {
+		plan_chunk(plan, chunk, &offset, &len);
+		if (read_full(fd, (char *)buf, len, offset) < 0) {
+			perror("Error reading source");
+			exit(1);
+		}
+		/* regions always start a chunk, so workers never need each other's data */
+		for (pos = 0; pos < len; pos += cut) {
+			cut = cdc ? cdc_cut(buf + pos, len - pos, avg) : (len - pos < avg ? len - pos : avg);
+			sha256_init(&sha);
+			sha256_update(&sha, buf + pos, cut);
+			sha256_final(&sha, rec.digest);
+			rec.offset = offset + pos;
+			rec.length = cut;
+			if (store_chunk(store, rec.digest, buf + pos, cut)) {
+				stat_add(stats->stored_chunks, 1);
+				stat_add(stats->stored_bytes, cut);
+			} else {
+				stat_add(stats->duplicate_chunks, 1);
+				stat_add(stats->duplicate_bytes, cut);
+			}
+			if (write(out, &rec, sizeof(rec)) != sizeof(rec)) {
+				perror("Error sending recipe entry");
+				exit(1);
+			}
+		}
+	}
+	free(buf);
+	close(fd);
+}
+
+static int compare_records(const void *a, const void *b) {
+	const StoreRecord *rec_a = (const StoreRecord *)a;
+	const StoreRecord *rec_b = (const StoreRecord *)b;
+	if (rec_a->offset != rec_b->offset)
+		return rec_a->offset < rec_b->offset ? -1 : 1;
+	return 0;
+}
+
+int store_file(int num_processes, size_t block_size, int cdc, const char *store, const char *source_file, const char *recipe_file) {
+	StoreRecord *recs = NULL;
+	StoreStats *stats;
+	struct stat st;
+	CopyPlan plan;
+	size_t region, count = 0, alloc = 0;
+	int pipe_fd[2], status, failed = 0, i;
+	double start, elapsed;
+	char hex[65];
+	ssize_t n;
+	FILE *fp;
+
+	if (stat(source_file, &st) < 0) {
+		perror("Error getting file status");
+		exit(1);
+	}
+	if (mkdir(store, 0755) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Error creating store %s: %s\n", store, strerror(errno));
+		exit(1);
+	}
+	gear_init();
+
+	/* workers claim whole regions, a multiple of the chunk size */
+	region = STORE_REGION / block_size * block_size;
+	if (region < block_size * 4)
+		region = block_size * 4;
+	plan_build(&plan, source_file, recipe_file, &st, region, NULL);
+
+	stats = mmap(NULL, sizeof(StoreStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED || pipe(pipe_fd) < 0) {
+		perror("Error setting up store workers");
+		exit(1);
+	}
+
+	start = now_seconds();
+	fflush(NULL);
+	for (i = 0; i < num_processes; i++) {
+		pid_t pid = fork();
+		if (pid < 0) {
+			perror("Error forking process");
+			exit(1);
+		} else if (pid == 0) {
+			close(pipe_fd[0]);
+			store_worker(&plan, store, cdc, block_size, stats, pipe_fd[1]);
+			exit(0);
+		}
+	}
+	close(pipe_fd[1]);
+
+	/* collect recipe entries until the last worker closes its end */
+	for (;;) {
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			recs = realloc(recs, alloc * sizeof(StoreRecord));
+			if (recs == NULL) {
+				perror("Failed to allocate memory for the recipe");
+				exit(1);
+			}
+		}
+		n = read(pipe_fd[0], &recs[count], sizeof(StoreRecord));
+		if (n == 0)
+			break;
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n != sizeof(StoreRecord)) {
+			perror("Error receiving recipe entry");
+			exit(1);
+		}
+		count++;
+	}
+	close(pipe_fd[0]);
+	for (i = 0; i < num_processes; i++) {
+		if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = 1;
+	}
+	elapsed = now_seconds() - start;
+	if (failed) {
+		fprintf(stderr, "Storing %s failed.\n", source_file);
+		exit(1);
+	}
+
+	qsort(recs, count, sizeof(StoreRecord), compare_records);
+	fp = fopen(recipe_file, "w");
+	if (fp == NULL) {
+		perror("Error creating recipe");
+		exit(1);
+	}
+	fprintf(fp, "dzcp-recipe 1\nsize %lld\n", (long long)st.st_size);
+	for (size_t j = 0; j < count; j++) {
+		digest_hex(recs[j].digest, hex);
+		fprintf(fp, "chunk %lld %u %s\n", (long long)recs[j].offset, recs[j].length, hex);
+	}
+	if (fclose(fp) != 0) {
+		perror("Error writing recipe");
+		exit(1);
+	}
+
+	printf("Operation completed in %.2f seconds.\n", elapsed);
+	printf("Throughput: %.2f MiB/s\n", (plan.total_bytes - plan.hole_bytes) / (1024.0 * 1024.0) / elapsed);
+	if (plan.hole_bytes > 0)
+		printf("Sparse: %.2f MiB of holes skipped\n", plan.hole_bytes / (1024.0 * 1024.0));
+	printf("Store: %zu chunks, %llu new (%.2f MiB written), %llu already stored (%.2f MiB deduplicated)\n",
+		   count, stats->stored_chunks, stats->stored_bytes / (1024.0 * 1024.0),
+		   stats->duplicate_chunks, stats->duplicate_bytes / (1024.0 * 1024.0));
+
+	munmap(stats, sizeof(StoreStats));
+	free(recs);
+	plan_free(&plan);
+	return 0;
+}
+
+/* rebuild a file from its recipe, every stored chunk is one file of the plan */
+void restore_file(int num_processes, size_t block_size, const CopyEngine *engine, const char *store, const char *recipe_file, const char *dest_file, const CopyOptions *opts, RunResult *result) {
+	char *line = NULL, hex[65], path[PATH_MAX];
+	long long size = -1, offset;
+	unsigned int length;
+	unsigned char digest[32];
+	struct stat st;
+	size_t alloc = 0;
+	CopyPlan plan;
+	int version = 0, dest_fd, i;
+	FILE *fp;
+
+	fp = fopen(recipe_file, "r");
+	if (fp == NULL) {
+		perror("Error opening recipe");
+		exit(1);
+	}
+	if (getline(&line, &alloc, fp) < 0 || sscanf(line, "dzcp-recipe %d", &version) != 1 || version != 1 ||
+		getline(&line, &alloc, fp) < 0 || sscanf(line, "size %lld", &size) != 1 || size < 0) {
+		fprintf(stderr, "%s is not a dzcp recipe.\n", recipe_file);
+		exit(1);
+	}
+
+	plan_init(&plan, block_size);
+	plan.dest_ready = 1;
+	while (getline(&line, &alloc, fp) > 0) {
+		if (sscanf(line, "chunk %lld %u %64s", &offset, &length, hex) != 3 || strlen(hex) != 64 ||
+			offset < 0 || offset + length > size) {
+			fprintf(stderr, "Invalid recipe line: %s", line);
+			exit(1);
+		}
+		for (i = 0; i < 32; i++)
+			sscanf(hex + i * 2, "%2hhx", &digest[i]);
+		store_chunk_path(store, digest, path, sizeof(path));
+		if (stat(path, &st) < 0 || st.st_size != length) {
+			fprintf(stderr, "Chunk %s is missing from the store or damaged.\n", hex);
+			exit(1);
+		}
+		plan_add_file(&plan, path, dest_file, length, 0644, 0);
+		plan.files[plan.file_count - 1].dest_offset = offset;
+		plan_add(&plan, plan.file_count - 1, 0, length, 0);
+	}
+	free(line);
+	fclose(fp);
+
+	/* regions not in the recipe were holes, sizing the file leaves them as holes */
+	dest_fd = open(dest_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (dest_fd < 0 || ftruncate(dest_fd, size) < 0) {
+		fprintf(stderr, "Error creating destination file %s: %s\n", dest_file, strerror(errno));
+		exit(1);
+	}
+	close(dest_fd);
+
+	printf("Restoring %d chunks (%.2f MiB).\n", plan.file_count, plan.total_bytes / (1024.0 * 1024.0));
+	run_plan(&plan, num_processes, engine, opts, result);
+	plan_free(&plan);
+}
+
+/*
+ * erasure coding
+ *
+ * --erasure K+M cuts the source into stripes of K units of the block size,
+ * and writes every stripe as K data shards plus M Reed-Solomon parity
+ * shards over GF(256), one shard file per destination. Any K of the K+M
+ * shard files are enough for --reconstruct to rebuild the source. The
+ * parity rows are a Cauchy matrix, so every K rows of the code are
+ * independent. Multiplying a buffer by a constant is two 16-entry table
+ * lookups per byte, done 16 or 32 bytes at a time with pshufb when the
+ * CPU has it. Workers claim stripes and write all shards of each.
+ */
+#define ERASURE_MAGIC	"dzcp-rs"
+/* shard data starts here, page aligned */
+#define ERASURE_HEADER	4096
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t k;
+	uint32_t m;
+	uint32_t index;
+	uint64_t unit;
+	uint64_t size;
+	/* the same for all shards of one encoding, so shards are never mixed */
+	uint64_t id;
+} ShardHeader;
+
+static unsigned char gf_exp[512], gf_log[256];
+/* products of each constant with the low and the high nibble of a byte */
+static unsigned char gf_nib[256][2][16];
+
+static void gf_init(void) {
+	int i, x = 1, c;
+
+	for (i = 0; i < 255; i++) {
+		gf_exp[i] = gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x & 0x100)
+			x ^= 0x11d;
+	}
+	for (c = 0; c < 256; c++) {
+		for (i = 0; i < 16; i++) {
+			gf_nib[c][0][i] = c && i ? gf_exp[gf_log[c] + gf_log[i]] : 0;
+			gf_nib[c][1][i] = c && i ? gf_exp[gf_log[c] + gf_log[i << 4]] : 0;
+		}
+	}
+}
+
+static unsigned char gf_mul(unsigned char a, unsigned char b) {
+	return a && b ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static unsigned char gf_inv(unsigned char a) {
+	return gf_exp[255 - gf_log[a]];
+}
+
+/* dst ^= c * src */
+static void gf_mul_add_scalar(unsigned char *dst, const unsigned char *src, unsigned char c, size_t len) {
+	const unsigned char *lo = gf_nib[c][0], *hi = gf_nib[c][1];
+
+	for (size_t i = 0; i < len; i++)
+		dst[i] ^= lo[src[i] & 0x0f] ^ hi[src[i] >> 4];
+}
+
+__attribute__((target("ssse3")))
+static void gf_mul_add_ssse3(unsigned char *dst, const unsigned char *src, unsigned char c, size_t len) {
+	__m128i lo = _mm_loadu_si128((const __m128i *)gf_nib[c][0]);
+	__m128i hi = _mm_loadu_si128((const __m128i *)gf_nib[c][1]);
+	__m128i mask = _mm_set1_epi8(0x0f), s, d;
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		s = _mm_loadu_si128((const __m128i *)(src + i));
+		d = _mm_loadu_si128((const __m128i *)(dst + i));
+		d = _mm_xor_si128(d, _mm_shuffle_epi8(lo, _mm_and_si128(s, mask)));
+		d = _mm_xor_si128(d, _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+		_mm_storeu_si128((__m128i *)(dst + i), d);
+	}
+	gf_mul_add_scalar(dst + i, src + i, c, len - i);
+}
+
+__attribute__((target("avx2")))
+static void gf_mul_add_avx2(unsigned char *dst, const unsigned char *src, unsigned char c, size_t len) {
+	__m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)gf_nib[c][0]));
+	__m256i hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)gf_nib[c][1]));
+	__m256i mask = _mm256_set1_epi8(0x0f), s, d;
+	size_t i;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		s = _mm256_loadu_si256((const __m256i *)(src + i));
+		d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		d = _mm256_xor_si256(d, _mm256_shuffle_epi8(lo, _mm256_and_si256(s, mask)));
+		d = _mm256_xor_si256(d, _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+		_mm256_storeu_si256((__m256i *)(dst + i), d);
+	}
+	gf_mul_add_scalar(dst + i, src + i, c, len - i);
+}
+
+static void (*gf_mul_add)(unsigned char *, const unsigned char *, unsigned char, size_t) = gf_mul_add_scalar;
+
+static const char *gf_select(void) {
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		gf_mul_add = gf_mul_add_avx2;
+		return "avx2";
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		gf_mul_add = gf_mul_add_ssse3;
+		return "ssse3";
+	}
+	gf_mul_add = gf_mul_add_scalar;
+	return "scalar";
+}
+
+/* row r of the (k + m) x k code: identity for data shards, Cauchy for parity */
+static unsigned char rs_coef(int k, int r, int i) {
+	if (r < k)
+		return r == i;
+	return gf_inv(r ^ i);
+}
+
+/* Gauss-Jordan inversion of a k x k matrix, returns -1 if it is singular */
+static int gf_invert(unsigned char *a, unsigned char *inv, int k) {
+	int i, j, r, p;
+	unsigned char t;
+
+	memset(inv, 0, k * k);
+	for (i = 0; i < k; i++)
+		inv[i * k + i] = 1;
+	for (i = 0; i < k; i++) {
+		for (p = i; p < k && a[p * k + i] == 0; p++)
+			;
+		if (p == k)
+			return -1;
+		for (j = 0; j < k; j++) {
+			t = a[i * k + j]; a[i * k + j] = a[p * k + j]; a[p * k + j] = t;
+			t = inv[i * k + j]; inv[i * k + j] = inv[p * k + j]; inv[p * k + j] = t;
+		}
+		t = gf_inv(a[i * k + i]);
+		for (j = 0; j < k; j++) {
+			a[i * k + j] = gf_mul(a[i * k + j], t);
+			inv[i * k + j] = gf_mul(inv[i * k + j], t);
+		}
+		for (r = 0; r < k; r++) {
+			if (r == i || a[r * k + i] == 0)
+				continue;
+			t = a[r * k + i];
+			for (j = 0; j < k; j++) {
+				a[r * k + j] ^= gf_mul(t, a[i * k + j]);
+				inv[r * k + j] ^= gf_mul(t, inv[i * k + j]);
+			}
+		}
+	}
+	return 0;
+}
+
+/* everything the workers of an encode or a reconstruct share */
+typedef struct {
+	int k, m;
+	size_t unit;
+	off_t size;
+	unsigned long long stripes;
+	/* one descriptor per shard, -1 for a missing shard */
+	int shard_fd[256];
+	int file_fd;
+	/* reconstruct: the k shards read and the matrix that turns them into data */
+	int use[256];
+	unsigned char decode[256 * 256];
+} ErasureJob;
+
+static void encode_stripes(const ErasureJob *job, unsigned long long *next) {
+	size_t unit = job->unit, len;
+	unsigned long long stripe;
+	unsigned char *buf;
+	off_t offset;
+	int i, j;
+
+	buf = malloc((job->k + job->m) * unit);
+	if (buf == NULL) {
+		perror("Failed to allocate memory for a stripe");
+		exit(1);
+	}
+	while ((stripe = __atomic_fetch_add(next, 1, __ATOMIC_RELAXED)) < job->stripes) {
+		offset = (off_t)stripe * job->k * unit;
+		len = job->size - offset < (off_t)(job->k * unit) ? job->size - offset : job->k * unit;
+		/* the last stripe is padded with zeros */
+		memset(buf + len, 0, (job->k + job->m) * unit - len);
+		if (read_full(job->file_fd, (char *)buf, len, offset) < 0) {
+			perror("Error reading source");
+			exit(1);
+		}
+		for (j = 0; j < job->m; j++)
+			for (i = 0; i < job->k; i++)
+				gf_mul_add(buf + (job->k + j) * unit, buf + i * unit, rs_coef(job->k, job->k + j, i), unit);
+		for (i = 0; i < job->k + job->m; i++) {
+			if (write_full(job->shard_fd[i], buf + i * unit, unit, ERASURE_HEADER + (off_t)stripe * unit) < 0) {
+				fprintf(stderr, "Error writing shard %d: %s\n", i, strerror(errno));
+				exit(1);
+			}
+		}
+	}
+	free(buf);
+}
+
+static void decode_stripes(const ErasureJob *job, unsigned long long *next) {
+	size_t unit = job->unit, len;
+	unsigned long long stripe;
+	unsigned char *in, *out;
+	off_t offset;
+	int i, r;
+
+	in = malloc(job->k * unit);
+	out = malloc(job->k * unit);
+	if (in == NULL || out == NULL) {
+		perror("Failed to allocate memory for a stripe");
+		exit(1);
+	}
+	while ((stripe = __atomic_fetch_add(next, 1, __ATOMIC_RELAXED)) < job->stripes) {
+		for (r = 0; r < job->k; r++) {
+			if (read_full(job->shard_fd[job->use[r]], (char *)in + r * unit, unit, ERASURE_HEADER + (off_t)stripe * unit) < 0) {
+				fprintf(stderr, "Error reading shard %d: %s\n", job->use[r], strerror(errno));
+				exit(1);
+			}
+		}
+		/* data shard i is row i of the inverse applied to the shards read */
+		memset(out, 0, job->k * unit);
+		for (i = 0; i < job->k; i++)
+			for (r = 0; r < job->k; r++)
+				if (job->decode[i * job->k + r] != 0)
+					gf_mul_add(out + i * unit, in + r * unit, job->decode[i * job->k + r], unit);
+		offset = (off_t)stripe * job->k * unit;
+		len = job->size - offset < (off_t)(job->k * unit) ? job->size - offset : job->k * unit;
+		if (write_full(job->file_fd, out, len, offset) < 0) {
+			perror("Error writing destination");
+			exit(1);
+		}
+	}
+	free(in);
+	free(out);
+}
+
+/* fork the workers on a shared stripe counter, returns the elapsed seconds */
+static double erasure_run(const ErasureJob *job, int num_processes, int encode) {
+	unsigned long long *next;
+	int status, failed = 0, i;
+	double start;
+	pid_t pid;
+
+	next = mmap(NULL, sizeof(*next), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (next == MAP_FAILED) {
+		perror("Error mapping shared statistics");
+		exit(1);
+	}
+	start = now_seconds();
+	fflush(NULL);
+	for (i = 0; i < num_processes; i++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("Error forking process");
+			exit(1);
+		} else if (pid == 0) {
+			if (encode)
+				encode_stripes(job, next);
+			else
+				decode_stripes(job, next);
+			exit(0);
+		}
+	}
+	for (i = 0; i < num_processes; i++) {
+		if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = 1;
+	}
+	munmap(next, sizeof(*next));
+	if (failed) {
+		fprintf(stderr, "%s failed.\n", encode ? "Encoding" : "Reconstruction");
+		exit(1);
+	}
+	return now_seconds() - start;
+}
+
+/* spec is K+M */
+void parse_erasure(const char *spec, int *k, int *m) {
+	if (sscanf(spec, "%d+%d", k, m) != 2 || *k < 1 || *m < 1 || *k + *m > 255) {
+		fprintf(stderr, "Invalid erasure code '%s', expected K+M with K + M at most 255\n", spec);
+		exit(1);
+	}
+}
+
+int erasure_encode(int num_processes, size_t block_size, int k, int m, const char *source_file, char **shards) {
+	ErasureJob *job;
+	ShardHeader hdr;
+	struct stat st;
+	double elapsed;
+	const char *simd;
+	int i;
+
+	gf_init();
+	simd = gf_select();
+	job = calloc(1, sizeof(ErasureJob));
+	if (job == NULL || stat(source_file, &st) < 0) {
+		perror("Error preparing the encoding");
+		exit(1);
+	}
+	job->k = k;
+	job->m = m;
+	job->unit = block_size;
+	job->size = st.st_size;
+	job->stripes = (st.st_size + (off_t)k * block_size - 1) / ((off_t)k * block_size);
+	job->file_fd = open(source_file, O_RDONLY);
+	if (job->file_fd < 0) {
+		perror("Error opening source file");
+		exit(1);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, ERASURE_MAGIC, sizeof(ERASURE_MAGIC));
+	hdr.version = 1;
+	hdr.k = k;
+	hdr.m = m;
+	hdr.unit = block_size;
+	hdr.size = st.st_size;
+	hdr.id = (uint64_t)getpid() << 32 ^ (uint64_t)(now_seconds() * 1000000.0);
+	for (i = 0; i < k + m; i++) {
+		job->shard_fd[i] = open(shards[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		hdr.index = i;
+		if (job->shard_fd[i] < 0 || write_full(job->shard_fd[i], (unsigned char *)&hdr, sizeof(hdr), 0) < 0 ||
+			ftruncate(job->shard_fd[i], ERASURE_HEADER + job->stripes * block_size) < 0) {
+			fprintf(stderr, "Error creating shard %s: %s\n", shards[i], strerror(errno));
+			exit(1);
+		}
+	}
+
+	printf("Encoding %.2f MiB into %d+%d shards of %.2f MiB using %s.\n", st.st_size / (1024.0 * 1024.0), k, m,
+		   job->stripes * block_size / (1024.0 * 1024.0), simd);
+	elapsed = erasure_run(job, num_processes, 1);
+	printf("Operation completed in %.2f seconds.\n", elapsed);
+	printf("Throughput: %.2f MiB/s of source, %.2f MiB/s written to %d shards\n",
+		   st.st_size / (1024.0 * 1024.0) / elapsed,
+		   job->stripes * block_size * (k + m) / (1024.0 * 1024.0) / elapsed, k + m);
+	for (i = 0; i < k + m; i++)
+		close(job->shard_fd[i]);
+	close(job->file_fd);
+	free(job);
+	return 0;
+}
+
+/* shards may be given in any order, missing ones are skipped */
+int erasure_reconstruct(int num_processes, char **shards, int count, const char *dest_file) {
+	ShardHeader hdr, first;
+	unsigned char *a;
+	ErasureJob *job;
+	double elapsed;
+	int fd, i, have = 0, missing_data = 0;
+	const char *simd;
+
+	gf_init();
+	simd = gf_select();
+	job = calloc(1, sizeof(ErasureJob));
+	if (job == NULL) {
+		perror("Error preparing the reconstruction");
+		exit(1);
+	}
+	for (i = 0; i < 256; i++)
+		job->shard_fd[i] = -1;
+	for (i = 0; i < count; i++) {
+		fd = open(shards[i], O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "Shard %s is missing: %s\n", shards[i], strerror(errno));
+			continue;
+		}
+		if (read_full(fd, (char *)&hdr, sizeof(hdr), 0) < 0 || memcmp(hdr.magic, ERASURE_MAGIC, sizeof(ERASURE_MAGIC)) != 0 ||
+			hdr.version != 1 || hdr.k < 1 || hdr.m < 1 || hdr.k + hdr.m > 255 || hdr.index >= hdr.k + hdr.m || hdr.unit == 0) {
+			fprintf(stderr, "%s is not a dzcp shard, skipped.\n", shards[i]);
+			close(fd);
+			continue;
+		}
+		if (have > 0 && (hdr.id != first.id || hdr.k != first.k || hdr.m != first.m)) {
+			fprintf(stderr, "%s belongs to another encoding, skipped.\n", shards[i]);
+			close(fd);
+			continue;
+		}
+		if (job->shard_fd[hdr.index] >= 0) {
+			close(fd);
+			continue;
+		}
+		if (have++ == 0)
+			first = hdr;
+		job->shard_fd[hdr.index] = fd;
+	}
+	if (have == 0 || have < (int)first.k) {
+		fprintf(stderr, "Only %d shards are usable, at least %u are needed.\n", have, have ? first.k : 0);
+		exit(1);
+	}
+
+	job->k = first.k;
+	job->m = first.m;
+	job->unit = first.unit;
+	job->size = first.size;
+	job->stripes = (first.size + (off_t)first.k * first.unit - 1) / ((off_t)first.k * first.unit);
+
+	/* read data shards where present, parity shards stand in for the others */
+	have = 0;
+	for (i = 0; i < job->k + job->m && have < job->k; i++) {
+		if (job->shard_fd[i] >= 0)
+			job->use[have++] = i;
+		else if (i < job->k)
+			missing_data++;
+	}
+	a = malloc(job->k * job->k);
+	for (int r = 0; r < job->k; r++)
+		for (i = 0; i < job->k; i++)
+			a[r * job->k + i] = rs_coef(job->k, job->use[r], i);
+	if (gf_invert(a, job->decode, job->k) < 0) {
+		fprintf(stderr, "The shards given cannot be decoded.\n");
+		exit(1);
+	}
+	free(a);
+
+	job->file_fd = open(dest_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (job->file_fd < 0 || ftruncate(job->file_fd, job->size) < 0) {
+		fprintf(stderr, "Error creating destination file %s: %s\n", dest_file, strerror(errno));
+		exit(1);
+	}
+	printf("Reconstructing %.2f MiB from %d+%d shards using %s, %d data shards rebuilt from parity.\n",
+		   job->size / (1024.0 * 1024.0), job->k, job->m, simd, missing_data);
+
+	elapsed = erasure_run(job, num_processes, 0);
+	printf("Operation completed in %.2f seconds.\n", elapsed);
+	printf("Throughput: %.2f MiB/s\n", job->size / (1024.0 * 1024.0) / elapsed);
+	for (i = 0; i < 256; i++)
+		if (job->shard_fd[i] >= 0)
+			close(job->shard_fd[i]);
+	close(job->file_fd);
+	free(job);
+	return 0;
+}
+
+/*
+ * encryption
+ *
+ * --encrypt and --decrypt copy through AES-GCM. The source is cut into
+ * chunks of the block size, each encrypted on its own with a nonce that
+ * is the container's random base nonce XOR the chunk number, and stored
+ * followed by its tag, so chunk N of the container is at a fixed offset
+ * and any worker can encrypt or decrypt any chunk. The header is the
+ * additional authenticated data of every chunk, binding the chunks to the
+ * plaintext size. AES rounds use AES-NI, eight blocks in flight, and
+ * GHASH uses carry-less multiplication, four blocks per reduction.
+ */
+#define CRYPT_MAGIC	"dzcpgcm"
+/* chunk data starts here, page aligned */
+#define CRYPT_HEADER	4096
+#define GCM_TAG		16
+
+/* optimized even in a plain build, unoptimized intrinsics run at a third of the speed */
+#define GCM_TARGET __attribute__((target("aes,pclmul,sse4.1"), optimize("O2")))
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t key_bits;
+	uint64_t chunk;
+	uint64_t size;
+	unsigned char nonce[12];
+	uint32_t reserved;
+} CryptHeader;
+
+typedef struct {
+	__m128i rk[15];
+	int rounds;
+	/* H, H^2, H^3 and H^4, byte reflected */
+	__m128i h[4];
+} GcmKey;
+
+GCM_TARGET static inline __m128i bswap128(__m128i x) {
+	return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+GCM_TARGET static inline __m128i aes_expand(__m128i key, __m128i assist) {
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, assist);
+}
+
+#define AES128_ROUND_KEY(i, rcon) \
+	k->rk[i] = aes_expand(k->rk[i - 1], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k->rk[i - 1], rcon), 0xff))
+/* AES-256 alternates a round key like AES-128's and one without rotation or rcon */
+#define AES256_ROUND_KEYS(i, rcon) \
+	k->rk[i] = aes_expand(k->rk[i - 2], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k->rk[i - 1], rcon), 0xff)); \
+	if (i + 1 < 15) \
+		k->rk[i + 1] = aes_expand(k->rk[i - 1], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k->rk[i], 0), 0xaa))
+
+GCM_TARGET static __m128i aes_encrypt_block(const GcmKey *k, __m128i b) {
+	b = _mm_xor_si128(b, k->rk[0]);
+	for (int r = 1; r < k->rounds; r++)
+		b = _mm_aesenc_si128(b, k->rk[r]);
+	return _mm_aesenclast_si128(b, k->rk[k->rounds]);
+}
+
+/* unreduced carry-less product, accumulated so several can share one reduction */
+GCM_TARGET static inline void clmul_acc(__m128i a, __m128i b, __m128i *lo, __m128i *mid, __m128i *hi) {
+	*lo = _mm_xor_si128(*lo, _mm_clmulepi64_si128(a, b, 0x00));
+	*hi = _mm_xor_si128(*hi, _mm_clmulepi64_si128(a, b, 0x11));
+	*mid = _mm_xor_si128(*mid, _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01)));
+}
+
+/* shift the reflected product left by one and reduce it modulo x^128 + x^7 + x^2 + x + 1 */
+GCM_TARGET static __m128i gf128_reduce(__m128i lo, __m128i mid, __m128i hi) {
+	__m128i t7, t8, t9, t2;
+
+	lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+	hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+	t7 = _mm_srli_epi32(lo, 31);
+	t8 = _mm_srli_epi32(hi, 31);
+	lo = _mm_slli_epi32(lo, 1);
+	hi = _mm_slli_epi32(hi, 1);
+	t9 = _mm_srli_si128(t7, 12);
+	t8 = _mm_slli_si128(t8, 4);
+	t7 = _mm_slli_si128(t7, 4);
+	lo = _mm_or_si128(lo, t7);
+	hi = _mm_or_si128(_mm_or_si128(hi, t8), t9);
+
+	t7 = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+	t8 = _mm_srli_si128(t7, 4);
+	lo = _mm_xor_si128(lo, _mm_slli_si128(t7, 12));
+	t2 = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+	lo = _mm_xor_si128(lo, _mm_xor_si128(t2, t8));
+	return _mm_xor_si128(hi, lo);
+}
+
+GCM_TARGET static __m128i gf128_mul(__m128i a, __m128i b) {
+	__m128i lo = _mm_setzero_si128(), mid = _mm_setzero_si128(), hi = _mm_setzero_si128();
+
+	clmul_acc(a, b, &lo, &mid, &hi);
+	return gf128_reduce(lo, mid, hi);
+}
+
+GCM_TARGET static void gcm_init(GcmKey *k, const unsigned char *key, int bits) {
+	k->rk[0] = _mm_loadu_si128((const __m128i *)key);
+	if (bits == 128) {
+		k->rounds = 10;
+		AES128_ROUND_KEY(1, 0x01); AES128_ROUND_KEY(2, 0x02); AES128_ROUND_KEY(3, 0x04);
+		AES128_ROUND_KEY(4, 0x08); AES128_ROUND_KEY(5, 0x10); AES128_ROUND_KEY(6, 0x20);
+		AES128_ROUND_KEY(7, 0x40); AES128_ROUND_KEY(8, 0x80); AES128_ROUND_KEY(9, 0x1b);
+		AES128_ROUND_KEY(10, 0x36);
+	} else {
+		k->rounds = 14;
+		k->rk[1] = _mm_loadu_si128((const __m128i *)(key + 16));
+		AES256_ROUND_KEYS(2, 0x01); AES256_ROUND_KEYS(4, 0x02); AES256_ROUND_KEYS(6, 0x04);
+		AES256_ROUND_KEYS(8, 0x08); AES256_ROUND_KEYS(10, 0x10); AES256_ROUND_KEYS(12, 0x20);
+		AES256_ROUND_KEYS(14, 0x40);
+	}
+	k->h[0] = bswap128(aes_encrypt_block(k, _mm_setzero_si128()));
+	for (int i = 1; i < 4; i++)
+		k->h[i] = gf128_mul(k->h[i - 1], k->h[0]);
+}
+
+/* fold data into the GHASH state x, a partial last block is zero padded */
+GCM_TARGET static __m128i ghash(const GcmKey *k, __m128i x, const unsigned char *p, size_t len) {
+	__m128i lo, mid, hi;
+	unsigned char last[16];
+	size_t i = 0;
+
+	for (; i + 64 <= len; i += 64) {
+		lo = mid = hi = _mm_setzero_si128();
+		clmul_acc(_mm_xor_si128(x, bswap128(_mm_loadu_si128((const __m128i *)(p + i)))), k->h[3], &lo, &mid, &hi);
+		clmul_acc(bswap128(_mm_loadu_si128((const __m128i *)(p + i + 16))), k->h[2], &lo, &mid, &hi);
+		clmul_acc(bswap128(_mm_loadu_si128((const __m128i *)(p + i + 32))), k->h[1], &lo, &mid, &hi);
+		clmul_acc(bswap128(_mm_loadu_si128((const __m128i *)(p + i + 48))), k->h[0], &lo, &mid, &hi);
+		x = gf128_reduce(lo, mid, hi);
+	}
+	for (; i + 16 <= len; i += 16)
+		x = gf128_mul(_mm_xor_si128(x, bswap128(_mm_loadu_si128((const __m128i *)(p + i)))), k->h[0]);
+	if (i < len) {
+		memset(last, 0, sizeof(last));
+		memcpy(last, p + i, len - i);
+		x = gf128_mul(_mm_xor_si128(x, bswap128(_mm_loadu_si128((const __m128i *)last))), k->h[0]);
+	}
+	return x;
+}
+
+/* counter mode from counter block ctr (big endian in the last word) */
+GCM_TARGET static void gcm_ctr(const GcmKey *k, const unsigned char nonce[12], uint32_t ctr, const unsigned char *in, unsigned char *out, size_t len) {
+	__m128i base, b[8];
+	unsigned char last[16];
+	size_t i = 0;
+	int j, r;
+
+	memcpy(last, nonce, 12);
+	memset(last + 12, 0, 4);
+	base = _mm_loadu_si128((const __m128i *)last);
+	for (; i + 128 <= len; i += 128, ctr += 8) {
+		for (j = 0; j < 8; j++)
+			b[j] = _mm_xor_si128(_mm_insert_epi32(base, __builtin_bswap32(ctr + j), 3), k->rk[0]);
+		for (r = 1; r < k->rounds; r++)
+			for (j = 0; j < 8; j++)
+				b[j] = _mm_aesenc_si128(b[j], k->rk[r]);
+		for (j = 0; j < 8; j++) {
+			b[j] = _mm_aesenclast_si128(b[j], k->rk[k->rounds]);
+			_mm_storeu_si128((__m128i *)(out + i + j * 16),
+							 _mm_xor_si128(b[j], _mm_loadu_si128((const __m128i *)(in + i + j * 16))));
+		}
+	}
+	for (; i < len; i += 16, ctr++) {
+		b[0] = aes_encrypt_block(k, _mm_insert_epi32(base, __builtin_bswap32(ctr), 3));
+		if (len - i >= 16) {
+			_mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(b[0], _mm_loadu_si128((const __m128i *)(in + i))));
+		} else {
+			_mm_storeu_si128((__m128i *)last, b[0]);
+			for (j = 0; j < (int)(len - i); j++)
+				out[i + j] = in[i + j] ^ last[j];
+		}
+	}
+}
+
+/* encrypt or decrypt len bytes, the tag is always that of the ciphertext */
+GCM_TARGET static void gcm_crypt(const GcmKey *k, const unsigned char nonce[12], const unsigned char *aad, size_t aad_len,
+								 const unsigned char *in, unsigned char *out, size_t len, int decrypt, unsigned char tag[GCM_TAG]) {
+	__m128i x = _mm_setzero_si128(), j0;
+	unsigned char block[16];
+
+	x = ghash(k, x, aad, aad_len);
+	if (decrypt)
+		x = ghash(k, x, in, len);
+	gcm_ctr(k, nonce, 2, in, out, len);
+	if (!decrypt)
+		x = ghash(k, x, out, len);
+	x = gf128_mul(_mm_xor_si128(x, _mm_set_epi64x(aad_len * 8, len * 8)), k->h[0]);
+
+	memcpy(block, nonce, 12);
+	block[12] = block[13] = block[14] = 0;
+	block[15] = 1;
+	j0 = aes_encrypt_block(k, _mm_loadu_si128((const __m128i *)block));
+	_mm_storeu_si128((__m128i *)tag, _mm_xor_si128(j0, bswap128(x)));
+}
+
+/* a key file holds 16 or 32 raw bytes, or 32 or 64 hex digits */
+int read_key(const char *path, unsigned char *key) {
+	unsigned char buf[160];
+	ssize_t n;
+	int fd, i;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror("Error opening key file");
+		exit(1);
+	}
+	n = read(fd, buf, sizeof(buf));
+	close(fd);
+	if (n == 16 || n == 32) {
+		memcpy(key, buf, n);
+		return n * 8;
+	}
+	while (n > 0 && (buf[n - 1] == '\n' || buf[n - 1] == '\r' || buf[n - 1] == ' '))
+		n--;
+	if (n == 32 || n == 64) {
+		buf[n] = '\0';
+		for (i = 0; i < n / 2; i++) {
+			if (!isxdigit(buf[i * 2]) || !isxdigit(buf[i * 2 + 1]) || sscanf((char *)buf + i * 2, "%2hhx", &key[i]) != 1)
+				break;
+		}
+		if (i == n / 2)
+			return n * 4;
+	}
+	fprintf(stderr, "The key file must hold a 128 or 256 bit key, raw or in hex.\n");
+	exit(1);
+}
+
+typedef struct {
+	GcmKey key;
+	CryptHeader header;
+	unsigned long long chunks;
+	int source_fd, dest_fd;
+	int decrypt;
+} CryptJob;
+
+static void crypt_chunks(const CryptJob *job, unsigned long long *next) {
+	size_t chunk = job->header.chunk, len;
+	unsigned char nonce[12], tag[GCM_TAG], *in, *out;
+	unsigned long long n;
+	off_t plain, sealed;
+	int i;
+
+	in = malloc(chunk + GCM_TAG);
+	out = malloc(chunk + GCM_TAG);
+	if (in == NULL || out == NULL) {
+		perror("Failed to allocate memory for a chunk");
+		exit(1);
+	}
+	while ((n = __atomic_fetch_add(next, 1, __ATOMIC_RELAXED)) < job->chunks) {
+		plain = (off_t)n * chunk;
+		sealed = CRYPT_HEADER + (off_t)n * (chunk + GCM_TAG);
+		len = job->header.size - plain < (off_t)chunk ? job->header.size - plain : chunk;
+		memcpy(nonce, job->header.nonce, 12);
+		for (i = 0; i < 8; i++)
+			nonce[4 + i] ^= n >> (56 - i * 8);
+
+		if (!job->decrypt) {
+			if (read_full(job->source_fd, (char *)in, len, plain) < 0) {
+				perror("Error reading source");
+				exit(1);
+			}
+			gcm_crypt(&job->key, nonce, (const unsigned char *)&job->header, sizeof(job->header), in, out, len, 0, out + len);
+			if (write_full(job->dest_fd, out, len + GCM_TAG, sealed) < 0) {
+				perror("Error writing destination");
+				exit(1);
+			}
+		} else {
+			if (read_full(job->source_fd, (char *)in, len + GCM_TAG, sealed) < 0) {
+				perror("Error reading source");
+				exit(1);
+			}
+			gcm_crypt(&job->key, nonce, (const unsigned char *)&job->header, sizeof(job->header), in, out, len, 1, tag);
+			/* compare without an early exit, the time taken says nothing about the tag */
+			unsigned char diff = 0;
+			for (i = 0; i < GCM_TAG; i++)
+				diff |= tag[i] ^ in[len + i];
+			if (diff != 0) {
+				fprintf(stderr, "Chunk %llu failed authentication: wrong key or damaged container.\n", n);
+				exit(1);
+			}
+			if (write_full(job->dest_fd, out, len, plain) < 0) {
+				perror("Error writing destination");
+				exit(1);
+			}
+		}
+	}
+	free(in);
+	free(out);
+}
+
+int crypt_file(int num_processes, size_t block_size, const char *key_file, int decrypt, const char *source_file, const char *dest_file) {
+	unsigned char key[32];
+	unsigned long long *next;
+	int status, failed = 0, i, bits;
+	struct stat st;
+	CryptJob job;
+	double start, elapsed;
+	pid_t pid;
+
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("aes") || !__builtin_cpu_supports("pclmul")) {
+		fprintf(stderr, "--encrypt and --decrypt need a CPU with AES-NI and PCLMULQDQ.\n");
+		exit(1);
+	}
+	bits = read_key(key_file, key);
+	memset(&job, 0, sizeof(job));
+	job.decrypt = decrypt;
+	gcm_init(&job.key, key, bits);
+	memset(key, 0, sizeof(key));
+
+	job.source_fd = open(source_file, O_RDONLY);
+	if (job.source_fd < 0 || fstat(job.source_fd, &st) < 0) {
+		perror("Error opening source file");
+		exit(1);
+	}
+	if (!decrypt) {
+		memcpy(job.header.magic, CRYPT_MAGIC, sizeof(CRYPT_MAGIC));
+		job.header.version = 1;
+		job.header.key_bits = bits;
+		job.header.chunk = block_size;
+		job.header.size = st.st_size;
+		if (getrandom(job.header.nonce, sizeof(job.header.nonce), 0) != sizeof(job.header.nonce)) {
+			perror("Error drawing a nonce");
+			exit(1);
+		}
+	} else if (read_full(job.source_fd, (char *)&job.header, sizeof(job.header), 0) < 0 ||
+			   memcmp(job.header.magic, CRYPT_MAGIC, sizeof(CRYPT_MAGIC)) != 0 || job.header.version != 1 ||
+			   job.header.chunk == 0 || job.header.chunk > (1ULL << 30)) {
+		fprintf(stderr, "%s is not a dzcp encrypted container.\n", source_file);
+		exit(1);
+	} else if ((int)job.header.key_bits != bits) {
+		fprintf(stderr, "%s was encrypted with a %u bit key, the key file holds a %d bit key.\n",
+				source_file, job.header.key_bits, bits);
+		exit(1);
+	}
+	job.chunks = (job.header.size + job.header.chunk - 1) / job.header.chunk;
+	if (decrypt && st.st_size != (off_t)(CRYPT_HEADER + job.header.size + job.chunks * GCM_TAG)) {
+		fprintf(stderr, "%s is truncated or damaged.\n", source_file);
+		exit(1);
+	}
+
+	job.dest_fd = open(dest_file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (job.dest_fd < 0 ||
+		ftruncate(job.dest_fd, decrypt ? (off_t)job.header.size : (off_t)(CRYPT_HEADER + job.header.size + job.chunks * GCM_TAG)) < 0 ||
+		(!decrypt && write_full(job.dest_fd, (unsigned char *)&job.header, sizeof(job.header), 0) < 0)) {
+		fprintf(stderr, "Error creating destination file %s: %s\n", dest_file, strerror(errno));
+		exit(1);
+	}
+
+	next = mmap(NULL, sizeof(*next), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (next == MAP_FAILED) {
+		perror("Error mapping shared statistics");
+		exit(1);
+	}
+	printf("%s %.2f MiB with AES-%d-GCM in %llu chunks of %llu KiB.\n", decrypt ? "Decrypting" : "Encrypting",
+		   job.header.size / (1024.0 * 1024.0), bits, job.chunks, (unsigned long long)job.header.chunk / 1024);
+	start = now_seconds();
+	fflush(NULL);
+	for (i = 0; i < num_processes; i++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("Error forking process");
+			exit(1);
+		} else if (pid == 0) {
+			crypt_chunks(&job, next);
+			exit(0);
+		}
+	}
+	for (i = 0; i < num_processes; i++) {
+		if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = 1;
+	}
+	elapsed = now_seconds() - start;
+	munmap(next, sizeof(*next));
+	close(job.source_fd);
+	close(job.dest_fd);
+	memset(&job.key, 0, sizeof(job.key));
+	if (failed) {
+		/* never leave a partly decrypted, unauthenticated file behind */
+		if (decrypt)
+			unlink(dest_file);
+		fprintf(stderr, "%s failed.\n", decrypt ? "Decryption" : "Encryption");
+		return 1;
+	}
+	printf("Operation completed in %.2f seconds.\n", elapsed);
+	printf("Throughput: %.2f MiB/s\n", job.header.size / (1024.0 * 1024.0) / elapsed);
+	return 0;
+}
+
+/*
+ * profiles
+ *
+ * The optimizer's pick for a source/destination device pair is kept in a
+ * small text file, one line per kind and pair:
+ *   KIND SRC_MAJ:MIN DST_MAJ:MIN ENGINE WORKERS SHIFT MIB_PER_SEC SAVED_AT
+ * and tree profiles go on with METADATA_BATCH SMALL_FILE_BYTES FILES_PER_SEC.
+ * A copy without -p, -s or -e takes the missing settings from it, and
+ * --explain uses the throughput to predict the duration.
+ */
+typedef struct {
+	char engine[32];
+	int workers;
+	int shift;
+	double throughput;
+	long long saved_at;
+	/* tree profiles only */
+	int metadata_batch;
+	long long small_file;
+	double files_per_sec;
+} Profile;
+
+void profile_path(char *path, size_t size) {
+	const char *env = getenv("DZCP_PROFILES");
+
+	if (env != NULL)
+		snprintf(path, size, "%s", env);
+	else if ((env = getenv("XDG_CACHE_HOME")) != NULL)
+		snprintf(path, size, "%s/dzcp/profiles", env);
+	else
+		snprintf(path, size, "%s/.cache/dzcp/profiles", getenv("HOME") != NULL ? getenv("HOME") : "/tmp");
+}
+
+/* profiles are per device pair, the destination may not exist yet */
+int profile_key(const char *source_file, const char *dest_file, char *key, size_t size) {
+	struct stat src_stat, dest_stat;
+
+	if (stat(source_file, &src_stat) < 0 || stat_dest(dest_file, &dest_stat) < 0)
+		return -1;
+	snprintf(key, size, "%u:%u %u:%u", major(src_stat.st_dev), minor(src_stat.st_dev),
+			 major(dest_stat.st_dev), minor(dest_stat.st_dev));
+	return 0;
+}
+
+int profile_load(const char *kind, const char *source_file, const char *dest_file, Profile *profile) {
+	char path[PATH_MAX], key[64], line[512], line_kind[16], src[32], dst[32], want[96], have[96];
+	FILE *fp;
+	int found = 0, end;
+
+	if (profile_key(source_file, dest_file, key, sizeof(key)) < 0)
+		return -1;
+	snprintf(want, sizeof(want), "%s %s", kind, key);
+	profile_path(path, sizeof(path));
+	fp = fopen(path, "r");
+	if (fp == NULL)
+		return -1;
+	while (!found && fgets(line, sizeof(line), fp) != NULL) {
+		if (sscanf(line, "%15s %31s %31s %31s %d %d %lf %lld%n", line_kind, src, dst, profile->engine,
+				   &profile->workers, &profile->shift, &profile->throughput, &profile->saved_at, &end) != 8)
+			continue;
+		snprintf(have, sizeof(have), "%s %s %s", line_kind, src, dst);
+		found = strcmp(have, want) == 0;
+		if (found && sscanf(line + end, "%d %lld %lf", &profile->metadata_batch, &profile->small_file,
+							&profile->files_per_sec) != 3) {
+			profile->metadata_batch = 0;
+			profile->small_file = 0;
+			profile->files_per_sec = 0.0;
+		}
+	}
+	fclose(fp);
+	return found ? 0 : -1;
+}
+
+static void make_parents(const char *path) {
+	char dir[PATH_MAX];
+
+	parent_dir(path, dir, sizeof(dir));
+	if (strcmp(dir, path) == 0 || access(dir, F_OK) == 0)
+		return;
+	make_parents(dir);
+	mkdir(dir, 0755);
+}
+
+/* replace the line for this kind and device pair */
+void profile_save(const char *kind, const char *source_file, const char *dest_file, const Profile *profile) {
+	char path[PATH_MAX], tmp[PATH_MAX + 8], key[64], want[96], line[512];
+	FILE *in, *out;
+
+	if (profile_key(source_file, dest_file, key, sizeof(key)) < 0)
+		return;
+	snprintf(want, sizeof(want), "%s %s ", kind, key);
+	profile_path(path, sizeof(path));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	make_parents(path);
+
+	out = fopen(tmp, "w");
+	if (out == NULL) {
+		fprintf(stderr, "Warning: could not save profile to %s: %s\n", path, strerror(errno));
+		return;
+	}
+	in = fopen(path, "r");
+	if (in != NULL) {
+		while (fgets(line, sizeof(line), in) != NULL) {
+			if (strncmp(line, want, strlen(want)) != 0)
+				fputs(line, out);
+		}
+		fclose(in);
+	}
+	fprintf(out, "%s%s %d %d %.2f %lld", want, profile->engine, profile->workers, profile->shift,
+			profile->throughput, profile->saved_at);
+	if (strcmp(kind, "tree") == 0)
+		fprintf(out, " %d %lld %.2f", profile->metadata_batch, profile->small_file, profile->files_per_sec);
+	fputc('\n', out);
+	if (fclose(out) != 0 || rename(tmp, path) < 0) {
+		fprintf(stderr, "Warning: could not save profile to %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		return;
+	}
+	printf("Saved %s profile for %s to %s\n", kind, key, path);
+}
+
+/*
+ * plan preview
+ *
+ * --explain resolves where the data lives, shows the settings and chunk
+ * plan a copy would use and predicts its duration from the profile of the
+ * device pair, or from a short read probe of the source when there is none.
+ * Nothing is written.
+ */
+
+/* "vda1 (252:1), ext4 on /, non-rotational" */
+void describe_location(const char *path, char *buf, size_t size) {
+	char line[4096], devname[64] = "", fstype[64] = "?", mnt[PATH_MAX] = "?", file[PATH_MAX], want[32], *sep;
+	unsigned int maj, min, disk_maj, disk_min;
+	struct stat st;
+	int rotational = -1;
+	FILE *fp;
+
+	if (stat_dest(path, &st) < 0) {
+		snprintf(buf, size, "unknown (%s)", strerror(errno));
+		return;
+	}
+	maj = major(st.st_dev);
+	min = minor(st.st_dev);
+
+	/* the last mount of this device wins, like the kernel's view */
+	snprintf(want, sizeof(want), "%u:%u", maj, min);
+	fp = fopen("/proc/self/mountinfo", "r");
+	while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+		char dev[32], point[PATH_MAX];
+		if (sscanf(line, "%*s %*s %31s %*s %4095s", dev, point) != 2 || strcmp(dev, want) != 0)
+			continue;
+		sep = strstr(line, " - ");
+		if (sep == NULL || sscanf(sep + 3, "%63s", fstype) != 1)
+			continue;
+		snprintf(mnt, sizeof(mnt), "%s", point);
+	}
+	if (fp != NULL)
+		fclose(fp);
+
+	snprintf(file, sizeof(file), "/sys/dev/block/%u:%u/uevent", maj, min);
+	fp = fopen(file, "r");
+	while (fp != NULL && fgets(line, sizeof(line), fp) != NULL) {
+		if (strncmp(line, "DEVNAME=", 8) == 0)
+			sscanf(line + 8, "%63s", devname);
+	}
+	if (fp != NULL)
+		fclose(fp);
+
+	if (disk_of_dev(st.st_dev, &disk_maj, &disk_min) == 0) {
+		snprintf(file, sizeof(file), "/sys/dev/block/%u:%u/queue/rotational", disk_maj, disk_min);
+		fp = fopen(file, "r");
+		if (fp != NULL) {
+			if (fscanf(fp, "%d", &rotational) != 1)
+				rotational = -1;
+			fclose(fp);
+		}
+	}
+
+	snprintf(buf, size, "%s%s(%u:%u), %s on %s%s", devname, devname[0] ? " " : "", maj, min, fstype, mnt,
+			 rotational == 1 ? ", rotational" : rotational == 0 ? ", non-rotational" : "");
+}
+
+/* read a few spread out ranges of the source with a cold cache, bytes/s */
+double probe_read_rate(const char *file, off_t size) {
+	const off_t sample = 16 * 1024 * 1024;
+	const int samples = 4;
+	double start, elapsed = 0.0;
+	off_t offset, done, total = 0;
+	ssize_t n;
+	char *buf;
+	int fd, i;
+
+	if (size < 1024 * 1024)
+		return 0.0;
+	fd = open(file, O_RDONLY);
+	buf = malloc(1024 * 1024);
+	if (fd < 0 || buf == NULL) {
+		if (fd >= 0)
+			close(fd);
+		free(buf);
+		return 0.0;
+	}
+	for (i = 0; i < samples; i++) {
+		offset = size > sample ? (size - sample) / (samples - 1) * i : 0;
+		offset &= ~(off_t)(1024 * 1024 - 1);
+		posix_fadvise(fd, offset, sample, POSIX_FADV_DONTNEED);
+		start = now_seconds();
+		for (done = 0; done < sample; done += n) {
+			n = pread(fd, buf, 1024 * 1024, offset + done);
+			if (n <= 0)
+				break;
+		}
+		elapsed += now_seconds() - start;
+		total += done;
+		if (size <= sample)
+			break;
+	}
+	close(fd);
+	free(buf);
+	return elapsed > 0.0 ? total / elapsed : 0.0;
+}
+
+void explain_copy(const CopyPlan *plan, int num_processes, const CopyEngine *engine, const char *settings_from,
+				  const char *dest, const CopyOptions *opts, int snapshot, const Profile *profile) {
+	char where[PATH_MAX + 128], when[64];
+	off_t copy_bytes = plan->total_bytes - plan->hole_bytes, shared;
+	struct stat st;
+	double rate;
+	time_t t;
+
+	printf("Plan (nothing is copied):\n");
+	describe_location(plan->files[0].source, where, sizeof(where));
+	if (plan->file_count > 1)
+		printf("  source:       %d files, the first is %s\n", plan->file_count, plan->files[0].source);
+	else
+		printf("  source:       %s\n", plan->files[0].source);
+	printf("                %s\n", where);
+	describe_location(dest, where, sizeof(where));
+	printf("  destination:  %s\n", dest);
+	printf("                %s\n", where);
+	printf("  settings:     from %s\n", settings_from);
+	printf("  engine:       %s, %s\n", engine->name, engine->description);
+	printf("  workers:      %d%s\n", num_processes, opts->deadline > 0.0 ? " at most, starting with 1" : "");
+	printf("  chunk size:   %zu KiB\n", plan->block_size / 1024);
+	printf("  layout:       %d file%s, %d segment%s, %llu chunks\n", plan->file_count, plan->file_count == 1 ? "" : "s",
+		   plan->count, plan->count == 1 ? "" : "s", plan->total_chunks);
+	if (plan->priority_chunks > 0)
+		printf("                %.2f MiB of priority ranges first (%llu chunks)\n",
+			   plan->priority_bytes / (1024.0 * 1024.0), plan->priority_chunks);
+	printf("  data:         %.2f MiB", plan->total_bytes / (1024.0 * 1024.0));
+	if (plan->hole_bytes > 0)
+		printf(", %.2f MiB in holes not copied", plan->hole_bytes / (1024.0 * 1024.0));
+	printf("\n");
+	if (plan->link_count > 0)
+		printf("  hardlinks:    %d more names linked, %.2f MiB not copied again\n", plan->link_count,
+			   plan->linked_bytes / (1024.0 * 1024.0));
+
+	if (opts->reference_file != NULL && stat(opts->reference_file, &st) == 0) {
+		shared = st.st_size < plan->total_bytes ? st.st_size : plan->total_bytes;
+		printf("  clone:        chunks matching %s are reflinked, up to %.2f MiB\n", opts->reference_file,
+			   shared / (1024.0 * 1024.0));
+	} else if ((engine->caps & ENGINE_CAP_REFLINK) && same_filesystem(plan->files[0].source, dest)) {
+		printf("  clone:        same filesystem, %s may share extents instead of copying\n", engine->name);
+	}
+	if (snapshot)
+		printf("  snapshot:     the source is cloned first and copied from the clone\n");
+	if (opts->cgroup.memory_high || opts->cgroup.memory_max || opts->cgroup.rbps || opts->cgroup.wbps)
+		printf("  cgroup:       memory.high %llu, memory.max %llu, rbps %llu, wbps %llu (0 = unlimited)\n",
+			   opts->cgroup.memory_high, opts->cgroup.memory_max, opts->cgroup.rbps, opts->cgroup.wbps);
+
+	if (profile != NULL) {
+		rate = profile->throughput * 1024.0 * 1024.0;
+		t = profile->saved_at;
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&t));
+		printf("  predicted:    %.1f seconds at %.2f MiB/s (profile from %s)\n", copy_bytes / rate, profile->throughput, when);
+	} else if ((rate = probe_read_rate(plan->files[0].source, plan->files[0].size)) > 0.0) {
+		printf("  predicted:    %.1f seconds at %.2f MiB/s (source read probe, run -o to profile the device pair)\n",
+			   copy_bytes / rate, rate / (1024.0 * 1024.0));
+	} else {
+		printf("  predicted:    unknown, no profile and too little data to probe\n");
+	}
+	if (opts->deadline > 0.0) {
+		t = opts->deadline;
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+		printf("  deadline:     %s\n", when);
+	}
+}
+
+/*
+ * background interference
+ *
+ * With --interference the optimizer runs every trial next to a synthetic
+ * tenant: processes doing random 4 KiB reads of the source (randread) or
+ * sequential 1 MiB writes to a scratch file beside the destination
+ * (seqwrite), with O_DIRECT where the filesystem allows it so the page
+ * cache does not hide the devices. The tenant's operation latencies go
+ * into a shared log-scale histogram. Measured alone first, the tenant's
+ * p99 latency and rate during a trial tell how much harm the trial's
+ * settings do to it.
+ */
+#define LOAD_READ_SIZE		4096
+#define LOAD_WRITE_SIZE		(1024 * 1024)
+/* the scratch file wraps around at this size */
+#define LOAD_WRITE_SPAN		(256LL * 1024 * 1024)
+#define LOAD_BASELINE_SECONDS	3
+/* histogram buckets are quarter octaves of microseconds */
+#define LOAD_BUCKETS		128
+
+typedef struct {
+	int stop;
+	unsigned long long ops;
+	unsigned long long hist[LOAD_BUCKETS];
+} LoadStats;
+
+typedef struct {
+	int readers, writers;
+	char scratch[PATH_MAX + 32];
+	LoadStats *stats;
+	pid_t pids[256];
+	int pid_count;
+	double started;
+} Interference;
+
+void interference_parse(Interference *load, const char *spec, const char *dest_file) {
+	char *copy, *tok, *save, *colon, dir[PATH_MAX];
+	int n;
+
+	memset(load, 0, sizeof(*load));
+	copy = strdup(spec);
+	for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		colon = strchr(tok, ':');
+		n = colon != NULL ? atoi(colon + 1) : 1;
+		if (colon != NULL)
+			*colon = '\0';
+		if (n < 1 || n > 64) {
+			fprintf(stderr, "Invalid interference process count in '%s'\n", spec);
+			exit(1);
+		}
+		if (strcmp(tok, "randread") == 0)
+			load->readers += n;
+		else if (strcmp(tok, "seqwrite") == 0)
+			load->writers += n;
+		else {
+			fprintf(stderr, "Unknown interference '%s', expected randread[:N] or seqwrite[:N]\n", tok);
+			exit(1);
+		}
+	}
+	free(copy);
+
+	parent_dir(dest_file, dir, sizeof(dir));
+	snprintf(load->scratch, sizeof(load->scratch), "%s/.dzcp-interference-%d", dir, getpid());
+	load->stats = mmap(NULL, sizeof(LoadStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (load->stats == MAP_FAILED) {
+		perror("Error mapping shared statistics");
+		exit(1);
+	}
+}
+
+static void load_record(LoadStats *stats, double seconds) {
+	double us = seconds * 1000000.0;
+	int b = us > 1.0 ? (int)(log2(us) * 4) : 0;
+
+	if (b >= LOAD_BUCKETS)
+		b = LOAD_BUCKETS - 1;
+	stat_add(stats->hist[b], 1);
+	stat_add(stats->ops, 1);
+}
+
+/*
+ * a sequential writer is a copy like any other: LOAD_WRITE_SIZE chunks from
+ * an in-memory pattern into the scratch file through the default engine
+ */
+static void load_writer(const Interference *load, int index) {
+	EngineCtx ctx = { .block_size = LOAD_WRITE_SIZE, .pipe_fd = { -1, -1 } };
+	const CopyEngine *engine = engines[0];
+	off_t pos = (off_t)index * LOAD_WRITE_SPAN / 8;
+	unsigned char *buf;
+	double t;
+
+	buf = malloc(LOAD_WRITE_SIZE);
+	ctx.source_fd = memfd_create("dzcp-interference", 0);
+	if (buf == NULL || ctx.source_fd < 0) {
+		perror("Failed to allocate memory for the interference");
+		exit(1);
+	}
+	memset(buf, 0x5a, LOAD_WRITE_SIZE);
+	if (write_full(ctx.source_fd, buf, LOAD_WRITE_SIZE, 0) < 0) {
+		perror("Error filling the interference pattern");
+		exit(1);
+	}
+	free(buf);
+	ctx.dest_fd = open(load->scratch, O_WRONLY | O_CREAT | O_DIRECT, 0600);
+	if (ctx.dest_fd < 0)
+		ctx.dest_fd = open(load->scratch, O_WRONLY | O_CREAT | O_DSYNC, 0600);
+	if (ctx.dest_fd < 0 || engine->init(&ctx) < 0) {
+		perror("Error opening the interference file");
+		exit(1);
+	}
+
+	while (!__atomic_load_n(&load->stats->stop, __ATOMIC_RELAXED)) {
+		t = now_seconds();
+		if (engine_copy_full(engine, &ctx, 0, pos, LOAD_WRITE_SIZE) < 0 || engine->flush(&ctx) < 0) {
+			fprintf(stderr, "Error writing the interference file with %s: %s\n", engine->name, strerror(errno));
+			exit(1);
+		}
+		pos = (pos + LOAD_WRITE_SIZE) % LOAD_WRITE_SPAN;
+		load_record(load->stats, now_seconds() - t);
+	}
+	engine->teardown(&ctx);
+	close(ctx.source_fd);
+	close(ctx.dest_fd);
+}
+
+/* random 4 KiB reads of the source, not a copy, so no engine */
+static void load_reader(const Interference *load, const char *source_file) {
+	unsigned int seed = getpid();
+	struct stat st;
+	off_t size;
+	void *buf;
+	double t;
+	int fd;
+
+	if (posix_memalign(&buf, 4096, LOAD_READ_SIZE) != 0) {
+		perror("Failed to allocate memory for the interference");
+		exit(1);
+	}
+	fd = open(source_file, O_RDONLY | O_DIRECT);
+	if (fd < 0)
+		fd = open(source_file, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror("Error opening the interference file");
+		exit(1);
+	}
+	size = st.st_size / LOAD_READ_SIZE;
+
+	while (!__atomic_load_n(&load->stats->stop, __ATOMIC_RELAXED)) {
+		t = now_seconds();
+		if (size > 0 && pread(fd, buf, LOAD_READ_SIZE, (off_t)(rand_r(&seed) % size) * LOAD_READ_SIZE) < 0) {
+			perror("Error reading the interference file");
+			exit(1);
+		}
+		load_record(load->stats, now_seconds() - t);
+	}
+	close(fd);
+	free(buf);
+}
+
+void interference_start(Interference *load, const char *source_file) {
+	pid_t pid;
+	int i;
+
+	memset(load->stats, 0, sizeof(LoadStats));
+	load->pid_count = 0;
+	fflush(NULL);
+	for (i = 0; i < load->readers + load->writers; i++) {
+		pid = fork();
+		if (pid < 0) {
+			perror("Error forking process");
+			exit(1);
+		} else if (pid == 0) {
+			if (i >= load->readers)
+				load_writer(load, i - load->readers);
+			else
+				load_reader(load, source_file);
+			exit(0);
+		}
+		load->pids[load->pid_count++] = pid;
+	}
+	load->started = now_seconds();
+}
+
+/* stop the load, returns its operations per second and p99 latency in seconds */
+void interference_stop(Interference *load, double *ops_per_sec, double *p99) {
+	unsigned long long seen = 0, ops;
+	double elapsed = now_seconds() - load->started;
+	int b, status;
+
+	__atomic_store_n(&load->stats->stop, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < load->pid_count; i++)
+		waitpid(load->pids[i], &status, 0);
+
+	ops = load->stats->ops;
+	*ops_per_sec = ops / elapsed;
+	for (b = 0; b < LOAD_BUCKETS - 1; b++) {
+		seen += load->stats->hist[b];
+		if (seen * 100 >= ops * 99)
+			break;
+	}
+	/* the bucket's upper bound */
+	*p99 = pow(2.0, (b + 1) / 4.0) / 1000000.0;
+}
+
+void interference_free(Interference *load) {
+	unlink(load->scratch);
+	munmap(load->stats, sizeof(LoadStats));
+}
+
+static int compare_run_harm(const void *a, const void *b) {
+	const RunResult *run_a = *(const RunResult **)a;
+	const RunResult *run_b = *(const RunResult **)b;
+	if (run_a->load_p99 != run_b->load_p99)
+		return (run_a->load_p99 > run_b->load_p99) - (run_a->load_p99 < run_b->load_p99);
+	return (run_a->load_ops < run_b->load_ops) - (run_a->load_ops > run_b->load_ops);
+}
+
+static int compare_run_throughput(const void *a, const void *b) {
+	const RunResult *run_a = *(const RunResult **)a;
+	const RunResult *run_b = *(const RunResult **)b;
+	return (run_a->throughput < run_b->throughput) - (run_a->throughput > run_b->throughput);
+}
+
+static void print_run_harm(const RunResult *run, double base_ops, double base_p99) {
+	printf("  -e %-15s -p %3d -s %2d  %9.2f MiB/s  load p99 %8.3f ms (x%.1f), %8.0f ops/s (%+.0f%%)\n",
+		   run->engine->name, run->num_processes, run->shift_value, run->throughput, run->load_p99 * 1000.0,
+		   run->load_p99 / base_p99, run->load_ops, 100.0 * (run->load_ops - base_ops) / base_ops);
+}
+
+/* rank the trials by throughput and by the harm done to the background load */
+void report_interference(RunResult *results, int run_count, double base_ops, double base_p99) {
+	RunResult **runs, *best = NULL;
+	int i, count = 0;
+
+	runs = malloc(run_count * sizeof(RunResult *));
+	if (runs == NULL) {
+		perror("Failed to allocate memory for the interference report");
+		exit(1);
+	}
+	for (i = 0; i < run_count; i++)
+		if (!results[i].failed)
+			runs[count++] = &results[i];
+	if (count == 0 || base_ops <= 0.0) {
+		free(runs);
+		return;
+	}
+
+	printf("\nBackground load alone: p99 %.3f ms, %.0f ops/s\n", base_p99 * 1000.0, base_ops);
+	qsort(runs, count, sizeof(RunResult *), compare_run_throughput);
+	printf("By throughput:\n");
+	for (i = 0; i < 5 && i < count; i++)
+		print_run_harm(runs[i], base_ops, base_p99);
+	qsort(runs, count, sizeof(RunResult *), compare_run_harm);
+	printf("By harm to the background load:\n");
+	for (i = 0; i < 5 && i < count; i++)
+		print_run_harm(runs[i], base_ops, base_p99);
+
+	/* the fastest trial that at most doubles the load's tail latency */
+	for (i = 0; i < count; i++)
+		if (runs[i]->load_p99 <= base_p99 * 2.0 && (best == NULL || runs[i]->throughput > best->throughput))
+			best = runs[i];
+	if (best != NULL) {
+		printf("Fastest within twice the load's p99:\n");
+		print_run_harm(best, base_ops, base_p99);
+	} else {
+		printf("Every trial more than doubled the load's p99.\n");
+	}
+	free(runs);
+}
+
+int compare_run_results(const void *a, const void *b) {
+	const RunResult *run_a = (const RunResult *)a;
+	const RunResult *run_b = (const RunResult *)b;
+	/* failed runs sort after all successful ones */
+	if (run_a->failed != run_b->failed)
+		return run_a->failed - run_b->failed;
+	return (run_a->elapsed_time > run_b->elapsed_time) - (run_a->elapsed_time < run_b->elapsed_time);
+}
+
+int compare_run_workers(const void *a, const void *b) {
+	const RunResult *run_a = *(const RunResult **)a;
+	const RunResult *run_b = *(const RunResult **)b;
+	return run_a->num_processes - run_b->num_processes;
+}
+
+/*
+ * Universal Scalability Law: X(N) = lambda * N / (1 + sigma * (N - 1) + kappa * N * (N - 1))
+ * sigma is the serialized (contention) fraction, kappa the crosstalk (coherency) cost.
+ * For a given sigma and kappa the best lambda has a closed form, so a coarse grid
+ * over sigma and kappa is enough for the handful of points one sweep produces.
+ */
+typedef struct {
+	double lambda;
+	double sigma;
+	double kappa;
+	double error;
+} UslFit;
+
+static double usl_shape(double n, double sigma, double kappa) {
+	return n / (1.0 + sigma * (n - 1.0) + kappa * n * (n - 1.0));
+}
+
+UslFit fit_usl(RunResult **points, int count) {
+	UslFit best = { 0.0, 0.0, 0.0, -1.0 };
+	double sigma, kappa, sum_xf, sum_ff, lambda, err, d, f;
+	int i;
+
+	for (sigma = 0.0; sigma < 1.0; sigma += 0.005) {
+		/* kappa == 0 first, then a geometric sweep from 1e-6 to 1 */
+		for (kappa = 0.0; kappa <= 1.0; kappa = kappa == 0.0 ? 1e-6 : kappa * 1.15) {
+			sum_xf = sum_ff = 0.0;
+			for (i = 0; i < count; i++) {
+				f = usl_shape(points[i]->num_processes, sigma, kappa);
+				sum_xf += points[i]->throughput * f;
+				sum_ff += f * f;
+			}
+			lambda = sum_xf / sum_ff;
+			err = 0.0;
+			for (i = 0; i < count; i++) {
+				d = points[i]->throughput - lambda * usl_shape(points[i]->num_processes, sigma, kappa);
+				err += d * d;
+			}
+			if (best.error < 0.0 || err < best.error) {
+				best.lambda = lambda;
+				best.sigma = sigma;
+				best.kappa = kappa;
+				best.error = err;
+			}
+		}
+	}
+	return best;
+}
+
+/*
+ * print throughput against worker count for every engine and block size pair,
+ * returns the smallest near-peak setting in best (failed if there is none)
+ */
+void report_scaling(RunResult *results, int run_count, RunResult *best) {
+	RunResult **points, *best_knee = NULL;
+	double peak, best_peak = 0.0, model_peak;
+	int i, j, count, knee, worse;
+	UslFit fit;
+
+	points = malloc(run_count * sizeof(RunResult *));
+	if (points == NULL) {
+		perror("Failed to allocate memory for scaling report");
+		exit(1);
+	}
+
+	printf("\nScaling curves (throughput against worker count):\n");
+	for (i = 0; i < run_count; i++) {
+		/* the first run of each engine and block size pair starts its curve */
+		for (j = 0; j < i; j++) {
+			if (results[j].engine == results[i].engine && results[j].block_size == results[i].block_size)
+				break;
+		}
+		if (j < i)
+			continue;
+
+		count = 0;
+		peak = 0.0;
+		for (j = i; j < run_count; j++) {
+			if (results[j].engine != results[i].engine || results[j].block_size != results[i].block_size || results[j].failed)
+				continue;
+			points[count++] = &results[j];
+			if (results[j].throughput > peak)
+				peak = results[j].throughput;
+		}
+		if (count == 0)
+			continue;
+		qsort(points, count, sizeof(RunResult *), compare_run_workers);
+
+		printf("\n-e %s -s %d (%zu KiB):\n", results[i].engine->name, results[i].shift_value, results[i].block_size / 1024);
+		knee = -1;
+		worse = -1;
+		for (j = 0; j < count; j++) {
+			printf("  -p %-4d %10.2f MiB/s  %3.0f%% of peak\n", points[j]->num_processes, points[j]->throughput,
+				   100.0 * points[j]->throughput / peak);
+			if (knee < 0 && points[j]->throughput >= KNEE_FRACTION * peak)
+				knee = j;
+			/* past the peak and clearly below it: more workers only contend */
+			if (worse < 0 && knee >= 0 && j > knee && points[j]->throughput < KNEE_FRACTION * peak &&
+				points[j]->throughput < points[j - 1]->throughput)
+				worse = j;
+		}
+
+		if (count >= 3) {
+			fit = fit_usl(points, count);
+			printf("  USL fit: %.2f MiB/s per worker, contention sigma %.3f, coherency kappa %.6f\n",
+				   fit.lambda, fit.sigma, fit.kappa);
+			/* a curve falling from the start puts the peak under one worker */
+			model_peak = fit.kappa > 0.0 ? sqrt((1.0 - fit.sigma) / fit.kappa) : 0.0;
+			if (model_peak < 1.0)
+				model_peak = 1.0;
+			if (fit.kappa > 0.0 && model_peak < 2.0)
+				printf("  model peaks at one worker (%.2f MiB/s), adding workers gives no scaling benefit\n",
+					   fit.lambda * usl_shape(1.0, fit.sigma, fit.kappa));
+			else if (fit.kappa > 0.0)
+				printf("  model peak at %.1f workers (%.2f MiB/s)\n", model_peak,
+					   fit.lambda * usl_shape(model_peak, fit.sigma, fit.kappa));
+			else
+				printf("  model shows no retrograde region, ceiling %.2f MiB/s\n",
+					   fit.sigma > 0.0 ? fit.lambda / fit.sigma : INFINITY);
+		}
+		printf("  knee: -p %d reaches %.0f%% of peak\n", points[knee]->num_processes, 100.0 * KNEE_FRACTION);
+		if (worse >= 0)
+			printf("  contention: throughput falls from -p %d onwards\n", points[worse]->num_processes);
+
+		if (peak > best_peak) {
+			best_peak = peak;
+			best_knee = points[knee];
+		}
+	}
+
+	best->failed = 1;
+	if (best_knee != NULL) {
+		printf("\nSmallest near-peak setting: -e %s -p %d -s %d (%zu KiB), %.2f MiB/s\n", best_knee->engine->name,
+			   best_knee->num_processes, best_knee->shift_value, best_knee->block_size / 1024, best_knee->throughput);
+		*best = *best_knee;
+	}
+
+	free(points);
+}
+
+void find_optimal_settings(const CopyEngine *only_engine, const char *source_file, const char *dest_file, const CopyOptions *opts) {
+	int processes_per_cpu, num_processes, num_cpus = get_nprocs();
+	const CopyEngine *engine;
+	RunResult best;
+	Profile profile;
+	/* 64KiB to 1024KiB */
+	size_t block_sizes[] = {64 * 1024, 128 * 1024, 256 * 1024, 512 * 1024, 1024 * 1024};
+	// RunResult results[MAX_RUNS] = {{0, }, };
+	RunResult *results;
+	int e, i, shift_value, run_index = 0;
+	Interference load;
+	double base_ops = 0.0, base_p99 = 0.0;
+
+	results = malloc(MAX_RUNS * sizeof(RunResult));
+	if (results == NULL) {
+		perror("Failed to allocate memory for results");
+		exit(1);
+	}
+	memset(results, 0, MAX_RUNS * sizeof(RunResult));
+
+	if (opts->interference != NULL) {
+		interference_parse(&load, opts->interference, dest_file);
+		drop_caches();
+		printf("Measuring the background load alone for %d seconds.\n", LOAD_BASELINE_SECONDS);
+		interference_start(&load, source_file);
+		sleep(LOAD_BASELINE_SECONDS);
+		interference_stop(&load, &base_ops, &base_p99);
+	}
+
+	/* without an explicit engine every registered one that fits is tried */
+	for (e = 0; engines[e] != NULL; e++) {
+		engine = engines[e];
+		if (only_engine != NULL && engine != only_engine)
+			continue;
+		if (!engine_usable(engine, source_file, dest_file)) {
+			printf("Skipping %s engine, source and destination are on different filesystems\n", engine->name);
+			continue;
+		}
+
+		for (processes_per_cpu = 1; processes_per_cpu <= 6; processes_per_cpu++) {
+			num_processes = processes_per_cpu * num_cpus;
+			for (i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]); i++) {
+				if (run_index >= MAX_RUNS) {
+					fprintf(stderr, "Exceeded maximum runs.\n");
+					break;
+				}
+
+				/* drop caches to flush page cache */
+				drop_caches();
+
+				/* shift starts at 6 and goes to 10 */
+				shift_value = 6 + i;
+				printf("Testing with -e %s -p %d and -s %d (%zu KiB)\n", engine->name, num_processes, shift_value, block_sizes[i] / 1024);
+				results[run_index].shift_value = shift_value;
+				if (opts->interference != NULL)
+					interference_start(&load, source_file);
+				perform_copy(num_processes, block_sizes[i], engine, source_file, dest_file, opts, &results[run_index]);
+				if (opts->interference != NULL) {
+					interference_stop(&load, &results[run_index].load_ops, &results[run_index].load_p99);
+					printf("Background load: p99 %.3f ms, %.0f ops/s\n", results[run_index].load_p99 * 1000.0,
+						   results[run_index].load_ops);
+				}
+
+				/* remove destination file for next run */
+				if (unlink(dest_file) < 0) {
+					perror("Error deleting destination file");
+					free(results);
+					exit(1);
+				}
+
+				run_index++;
+			}
+		}
+	}
+
+	report_scaling(results, run_index, &best);
+	if (opts->interference != NULL) {
+		report_interference(results, run_index, base_ops, base_p99);
+		interference_free(&load);
+	}
+	if (!best.failed) {
+		snprintf(profile.engine, sizeof(profile.engine), "%s", best.engine->name);
+		profile.workers = best.num_processes;
+		profile.shift = best.shift_value;
+		profile.throughput = best.throughput;
+		profile.saved_at = time(NULL);
+		profile_save("copy", source_file, dest_file, &profile);
+	}
+
+	/* sort the results based on elapsed_time (ascending) */
+	qsort(results, run_index, sizeof(RunResult), compare_run_results);
+
+	printf("\nFastest 5 runs:\n");
+	for (i = 0; i < 5 && i < run_index && !results[i].failed; i++) {
+		printf("Run %d: -e %s -p %d -s %d (%zu KiB), %.2f seconds\n", i + 1, results[i].engine->name,
+			   results[i].num_processes, results[i].shift_value, results[i].block_size / 1024, results[i].elapsed_time);
+	}
+
+	/* failed runs are at the end, skip them */
+	while (run_index > 0 && results[run_index - 1].failed)
+		run_index--;
+
+	printf("\nSlowest 5 runs:\n");
+	for (i = run_index - 1; i >= run_index - 5 && i >= 0; i--) {
+		printf("Run %d: -e %s -p %d -s %d (%zu KiB), %.2f seconds\n", run_index - i, results[i].engine->name,
+			   results[i].num_processes, results[i].shift_value, results[i].block_size / 1024, results[i].elapsed_time);
+	}
+
+	free(results);
+}
+
+/*
+ * multi-tenant benchmark
+ *
+ * --tenants 2,4,16 measures what happens when several dzcp copies share a
+ * device pair: for each count N, N independent copy jobs, each with its
+ * own generated source file and its own workers, are released at the same
+ * moment. Per job settings cycle through --tenant-settings. The report
+ * gives aggregate and per-job throughput, Jain's fairness index over the
+ * per-job throughputs (1 when all jobs get the same, 1/N when one job gets
+ * everything) and the spread of completion times. The source files are
+ * generated in a fresh directory under the dataset directory and removed
+ * with it afterwards.
+ */
+#define TENANT_MAX	256
+#define TENANT_ROUNDS	64
+
 typedef struct {
-	int num_processes;
-	size_t block_size;
-	double elapsed_time;
-	int shift_value;
-} RunResult;
+	int workers;
+	int shift;
+	const CopyEngine *engine;
+} TenantSettings;
 
-void about(void) {
-	printf("dzcp: Dragan's Zero-Copy v%s, <dragan@stancevic.com>\n", VER);
+typedef struct {
+	int go;
+	double start;
+	struct {
+		double done_at;
+		double throughput;
+		int failed;
+	} job[TENANT_MAX];
+} TenantBoard;
+
+/* SPEC is a comma separated list of WORKERS:SHIFT[:ENGINE] */
+int parse_tenant_settings(const char *spec, TenantSettings *settings, int max) {
+	char *copy, *tok, *save, *colon;
+	int count = 0;
+
+	copy = strdup(spec);
+	for (tok = strtok_r(copy, ",", &save); tok != NULL && count < max; tok = strtok_r(NULL, ",", &save)) {
+		settings[count].engine = NULL;
+		if (sscanf(tok, "%d:%d", &settings[count].workers, &settings[count].shift) != 2 ||
+			settings[count].workers < 1 || settings[count].shift < 6 || settings[count].shift > 16) {
+			fprintf(stderr, "Invalid tenant settings '%s', expected WORKERS:SHIFT[:ENGINE]\n", tok);
+			exit(1);
+		}
+		colon = strchr(strchr(tok, ':') + 1, ':');
+		if (colon != NULL && (settings[count].engine = find_engine(colon + 1)) == NULL) {
+			fprintf(stderr, "Unknown copy engine '%s', use -E to list them.\n", colon + 1);
+			exit(1);
+		}
+		count++;
+	}
+	free(copy);
+	return count;
 }
 
-void drop_caches() {
-	FILE *fp = fopen("/proc/sys/vm/drop_caches", "w");
-	if (fp == NULL) {
-		perror("Error opening /proc/sys/vm/drop_caches");
+/* write size bytes of incompressible data into a new file */
+static void generate_dataset(const char *path, off_t size) {
+	uint64_t x = 0x9e3779b97f4a7c15ULL ^ (uint64_t)size, *buf;
+	size_t chunk = 1024 * 1024, i;
+	off_t done;
+	int fd;
+
+	buf = malloc(chunk);
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (buf == NULL || fd < 0) {
+		fprintf(stderr, "Error creating dataset %s: %s\n", path, strerror(errno));
 		exit(1);
 	}
-	fprintf(fp, "3");
-	fclose(fp);
+	for (done = 0; done < size; done += chunk) {
+		for (i = 0; i < chunk / sizeof(uint64_t); i++) {
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			buf[i] = x;
+		}
+		if (write_full(fd, (unsigned char *)buf, size - done < (off_t)chunk ? size - done : chunk, done) < 0) {
+			fprintf(stderr, "Error writing dataset %s: %s\n", path, strerror(errno));
+			exit(1);
+		}
+	}
+	/* the benchmark should find the dataset on the device, not dirty in memory */
+	fsync(fd);
+	close(fd);
+	free(buf);
+}
+
+static double nearest_rank(const double *sorted, int n, double q) {
+	int rank = (int)ceil(q * n);
+	return sorted[rank > 0 ? rank - 1 : 0];
 }
 
-void copy_blocks(const char *source_file, const char *dest_file, off_t file_size, int process_num, int num_processes, size_t block_size) {
-	/* initial offset for this process */
-	off_t offset = process_num * block_size;
-	off_t dest_offset = offset;
-	ssize_t to_send, bytes_sent;
-	int dest_fd, source_fd;
+void tenant_benchmark(const char *counts, const TenantSettings *settings, int setting_count, off_t dataset_size,
+					  const char *source_dir, const char *dest_dir, const CopyOptions *opts) {
+	char *copy, *tok, *save, data_dir[PATH_MAX], src[PATH_MAX + 32], dst[PATH_MAX + 32];
+	double done[TENANT_MAX], sum, sum_sq, makespan, aggregate, jain;
+	double summary[TENANT_ROUNDS][6];
+	int n, i, max_n = 0, rounds = 0, status, devnull;
+	const TenantSettings *s;
+	TenantBoard *board;
+	pid_t pid, pids[TENANT_MAX];
+	int ok, jobs;
+
+	copy = strdup(counts);
+	for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		n = atoi(tok);
+		if (n < 1 || n > TENANT_MAX) {
+			fprintf(stderr, "Invalid tenant count '%s', 1 to %d\n", tok, TENANT_MAX);
+			exit(1);
+		}
+		if (n > max_n)
+			max_n = n;
+		if (++rounds > TENANT_ROUNDS) {
+			fprintf(stderr, "Too many tenant counts, at most %d\n", TENANT_ROUNDS);
+			exit(1);
+		}
+	}
+	free(copy);
+	rounds = 0;
 
-	/* each process opens its own source and destination file descriptors */
-	source_fd = open(source_file, O_RDONLY);
-	if (source_fd < 0) {
-		perror("Error opening source file in child process");
+	/* never reuse or remove files this run did not create */
+	snprintf(data_dir, sizeof(data_dir), "%s/dzcp-tenants-XXXXXX", source_dir);
+	if (mkdtemp(data_dir) == NULL) {
+		fprintf(stderr, "Error creating dataset directory in %s: %s\n", source_dir, strerror(errno));
 		exit(1);
 	}
+	printf("Generating %d datasets of %.2f MiB in %s.\n", max_n, dataset_size / (1024.0 * 1024.0), data_dir);
+	for (i = 0; i < max_n; i++) {
+		snprintf(src, sizeof(src), "%s/%d", data_dir, i);
+		generate_dataset(src, dataset_size);
+	}
+	if (geteuid() != 0)
+		printf("Not root, page caches are not dropped between rounds.\n");
 
-	dest_fd = open(dest_file, O_WRONLY);
-	if (dest_fd < 0) {
-		perror("Error opening destination file in child process");
-		close(source_fd);
+	board = mmap(NULL, sizeof(TenantBoard), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (board == MAP_FAILED) {
+		perror("Error mapping shared statistics");
 		exit(1);
 	}
 
-	/* print offsets being written */
-	// printf("process %d: writing from offset %lld to offset %lld\n", process_num, (long long)offset, (long long)dest_offset);
+	copy = strdup(counts);
+	for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		n = atoi(tok);
+		if (geteuid() == 0)
+			drop_caches();
+		memset(board, 0, sizeof(TenantBoard));
 
-	while (offset < file_size) {
-		// Ensure the destination file is correctly positioned
-		if (lseek(dest_fd, dest_offset, SEEK_SET) == (off_t)-1) {
-			perror("Error seeking in destination file");
-			close(source_fd);
-			close(dest_fd);
-			exit(1);
+		fflush(NULL);
+		for (i = 0; i < n; i++) {
+			pid = fork();
+			if (pid < 0) {
+				perror("Error forking process");
+				exit(1);
+			} else if (pid == 0) {
+				RunResult result;
+
+				/* a job's own report would interleave with the others */
+				devnull = open("/dev/null", O_WRONLY);
+				if (devnull >= 0)
+					dup2(devnull, STDOUT_FILENO);
+				s = &settings[i % setting_count];
+				snprintf(src, sizeof(src), "%s/%d", data_dir, i);
+				snprintf(dst, sizeof(dst), "%s/dzcp-tenant-%d", dest_dir, i);
+				while (!__atomic_load_n(&board->go, __ATOMIC_ACQUIRE))
+					usleep(100);
+				perform_copy(s->workers, 64 * 1024 * (1 << (s->shift - 6)), s->engine, src, dst, opts, &result);
+				board->job[i].done_at = now_seconds() - board->start;
+				board->job[i].throughput = result.throughput;
+				board->job[i].failed = result.failed;
+				unlink(dst);
+				exit(0);
+			}
+			pids[i] = pid;
+		}
+		/* release all jobs at once */
+		board->start = now_seconds();
+		__atomic_store_n(&board->go, 1, __ATOMIC_RELEASE);
+		/* a job that exited early never wrote its results */
+		for (i = 0; i < n; i++) {
+			if (waitpid(pids[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+				board->job[i].failed = 1;
 		}
 
-		/* perform the sendfile operation */
-		to_send = block_size;
-		while (to_send > 0 && offset < file_size) {
-			bytes_sent = sendfile(dest_fd, source_fd, &offset, to_send);
-			if (bytes_sent <= 0) {
-				if (errno == EINTR || errno == EAGAIN) {
-					/* retry in case of interruptions or non-blocking operation */
-					continue;
-				} else {
-					perror("Error during sendfile");
-					close(source_fd);
-					close(dest_fd);
-					exit(1);
-				}
+		printf("\n%d concurrent job%s:\n", n, n == 1 ? "" : "s");
+		sum = sum_sq = makespan = 0.0;
+		ok = 0;
+		for (i = 0; i < n; i++) {
+			s = &settings[i % setting_count];
+			if (board->job[i].failed) {
+				printf("  job %3d  -e %-15s -p %3d -s %2d  FAILED\n", i + 1, s->engine->name, s->workers, s->shift);
+				continue;
 			}
-			to_send -= bytes_sent;
+			printf("  job %3d  -e %-15s -p %3d -s %2d  %9.2f MiB/s  done after %7.2f seconds\n", i + 1, s->engine->name,
+				   s->workers, s->shift, board->job[i].throughput, board->job[i].done_at);
+			sum += board->job[i].throughput;
+			sum_sq += board->job[i].throughput * board->job[i].throughput;
+			done[ok++] = board->job[i].done_at;
+			if (board->job[i].done_at > makespan)
+				makespan = board->job[i].done_at;
+		}
+		if (ok == 0) {
+			printf("  all jobs failed\n");
+			continue;
 		}
+		if (ok < n)
+			printf("  %d failed job%s left out below\n", n - ok, n - ok == 1 ? "" : "s");
+		jobs = n;
+		n = ok;
+		qsort(done, n, sizeof(double), compare_doubles);
+		aggregate = n * dataset_size / (1024.0 * 1024.0) / makespan;
+		jain = sum_sq > 0.0 ? sum * sum / (n * sum_sq) : 0.0;
+		printf("  aggregate %.2f MiB/s, per job mean %.2f MiB/s, Jain's fairness index %.3f\n", aggregate, sum / n, jain);
+		printf("  completion p50 %.2f, p95 %.2f, p99 %.2f, max %.2f seconds\n", nearest_rank(done, n, 0.5),
+			   nearest_rank(done, n, 0.95), nearest_rank(done, n, 0.99), done[n - 1]);
 
-		/* move the destination and source file pointers for the next block handled by this process */
-		/* skip blocks for the other processes */
-		dest_offset += num_processes * block_size;
-		/* skip source blocks that other processes will handle */
-		offset += (num_processes - 1) * block_size;
+		summary[rounds][0] = jobs;
+		summary[rounds][1] = aggregate;
+		summary[rounds][2] = sum / n;
+		summary[rounds][3] = jain;
+		summary[rounds][4] = nearest_rank(done, n, 0.5);
+		summary[rounds][5] = done[n - 1];
+		rounds++;
 	}
+	free(copy);
 
-	/* close file descriptors after done */
-	close(source_fd);
-	close(dest_fd);
+	printf("\n%6s %14s %14s %8s %10s %10s\n", "jobs", "aggregate", "per job", "Jain", "p50 done", "max done");
+	for (i = 0; i < rounds; i++)
+		printf("%6.0f %9.2f MiB/s %9.2f MiB/s %8.3f %9.2fs %9.2fs\n", summary[i][0], summary[i][1], summary[i][2],
+			   summary[i][3], summary[i][4], summary[i][5]);
+
+	for (i = 0; i < max_n; i++) {
+		snprintf(src, sizeof(src), "%s/%d", data_dir, i);
+		unlink(src);
+	}
+	if (rmdir(data_dir) < 0)
+		fprintf(stderr, "Warning: could not remove %s: %s\n", data_dir, strerror(errno));
+	munmap(board, sizeof(TenantBoard));
 }
 
-void perform_copy(int num_processes, size_t block_size, const char *source_file, const char *dest_file, RunResult *result) {
-	struct stat file_stat;
-	off_t file_size;
-	pid_t pid;
-	int dest_fd;
+/*
+ * files-per-second optimizer
+ *
+ * -o with -R tunes a streamed tree copy rather than a block copy: the
+ * number of copy workers (files in flight), --metadata-batch (how many
+ * small-file names go into one queue record, the only metadata batching
+ * there is) and the --small-files threshold, ranked by files per second.
+ * The knobs are
+ * tuned one after another, each with the best of those before it, which
+ * takes about fifteen trials instead of the whole grid. The sample is the
+ * source tree itself or one generated by --tree-sample FILES[:SIZE] in a
+ * temporary directory beside the source, never in it, with sizes spread
+ * log-uniformly from 512 bytes to SIZE, mostly small like real small-file
+ * trees. Trials copy into a scratch directory under the destination that
+ * is removed after each one, and the pick is saved as the tree profile of
+ * the device pair the trials actually ran on.
+ */
+#define TREE_TRIALS	32
+#define TREE_SAMPLE	"dzcp-tree-sample-XXXXXX"
+#define TREE_SCRATCH	"dzcp-tree-trial"
 
-	if (stat(source_file, &file_stat) < 0) {
-		perror("Error getting file status");
+typedef struct {
+	int workers;
+	int metadata_batch;
+	off_t small_file;
+	RunResult result;
+} TreeTrial;
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+	return remove(path);
+}
+
+static void remove_tree(const char *path) {
+	if (access(path, F_OK) == 0 && nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS) < 0)
+		fprintf(stderr, "Warning: could not remove %s: %s\n", path, strerror(errno));
+}
+
+/* FILES[:SIZE], 256 files per directory */
+static void generate_tree(const char *dir, const char *spec) {
+	uint64_t x = 0x9e3779b97f4a7c15ULL;
+	unsigned long long max_size = 1024 * 1024;
+	char path[PATH_MAX], *colon;
+	unsigned char *data;
+	long files, i;
+	off_t size;
+	size_t j;
+	int fd;
+
+	files = atol(spec);
+	if ((colon = strchr(spec, ':')) != NULL)
+		max_size = parse_size(colon + 1);
+	if (files < 1 || max_size < 512) {
+		fprintf(stderr, "Invalid tree sample '%s', expected FILES[:SIZE] of at least 512 bytes\n", spec);
 		exit(1);
 	}
-	file_size = file_stat.st_size;
-
-	/* parent process: ensure the destination file is created if it doesn't exist */
-	dest_fd = open(dest_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-	if (dest_fd < 0) {
-		perror("Error creating destination file");
+	data = malloc(max_size);
+	if (data == NULL) {
+		perror("Error allocating the sample data");
 		exit(1);
 	}
-	/* parent closes the file; child processes will reopen it */
-	close(dest_fd);
-
-	struct timeval start_time, end_time;
-	gettimeofday(&start_time, NULL);
+	for (j = 0; j < max_size; j++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		data[j] = x;
+	}
 
-	/* fork processes to zero-copy the file in parallel */
-	for (int i = 0; i < num_processes; i++) {
-		pid = fork();
-		if (pid < 0) {
-			perror("Error forking process");
+	printf("Generating a sample tree of %ld files of up to %llu KiB in %s.\n", files, max_size / 1024, dir);
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		fprintf(stderr, "Error creating directory %s: %s\n", dir, strerror(errno));
+		exit(1);
+	}
+	for (i = 0; i < files; i++) {
+		if (i % 256 == 0) {
+			snprintf(path, sizeof(path), "%s/d%04ld", dir, i / 256);
+			mkdir(path, 0755);
+		}
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		size = exp(log(512.0) + (x >> 11) / 9007199254740992.0 * (log((double)max_size) - log(512.0)));
+		snprintf(path, sizeof(path), "%s/d%04ld/f%06ld", dir, i / 256, i);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0 || write_full(fd, data + (x % (max_size - size + 1)), size, 0) < 0) {
+			fprintf(stderr, "Error writing sample file %s: %s\n", path, strerror(errno));
 			exit(1);
-		} else if (pid == 0) {
-			/* child process perform the file copy with its own file descriptors */
-			copy_blocks(source_file, dest_file, file_size, i, num_processes, block_size);
-			/* exit the child process */
-			exit(0);
 		}
+		close(fd);
 	}
-
-	/* parent process waits for all child processes */
-	for (int i = 0; i < num_processes; i++) {
-		wait(NULL);
-	}
-
-	gettimeofday(&end_time, NULL);
-	result->num_processes = num_processes;
-	result->block_size = block_size;
-	result->elapsed_time = (end_time.tv_sec - start_time.tv_sec) + 
-						   (end_time.tv_usec - start_time.tv_usec) / 1000000.0;
-
-	double throughput = (double)file_size / (1024.0 * 1024.0 * result->elapsed_time);
-	printf("Operation completed in %.2f seconds.\n", result->elapsed_time);
-	printf("Throughput: %.2f MiB/s\n", throughput);
-}
-
-int compare_run_results(const void *a, const void *b) {
-	const RunResult *run_a = (const RunResult *)a;
-	const RunResult *run_b = (const RunResult *)b;
-	return (run_a->elapsed_time > run_b->elapsed_time) - (run_a->elapsed_time < run_b->elapsed_time);
+	free(data);
+	/* trials should read the sample from the device */
+	sync();
 }
 
-void find_optimal_settings(const char *source_file, const char *dest_file) {
-	int processes_per_cpu, num_processes, num_cpus = get_nprocs();
-	/* 64KiB to 1024KiB */
-	size_t block_sizes[] = {64 * 1024, 128 * 1024, 256 * 1024, 512 * 1024, 1024 * 1024};
-	// RunResult results[MAX_RUNS] = {{0, }, };
-	RunResult *results;
-	int i, shift_value, run_index = 0;
+/* the trial with these settings, run now unless an earlier stage ran it */
+static TreeTrial *tree_trial(TreeTrial *trials, int *count, int workers, int metadata_batch, off_t small_file,
+							 const CopyEngine *engine, size_t block_size, const char *source, const char *scratch,
+							 const CopyOptions *base) {
+	CopyOptions opts = *base;
+	LinkTable links;
+	TreeTrial *t;
+	int i;
 
-	results = malloc(MAX_RUNS * sizeof(RunResult));
-	if (results == NULL) {
-		perror("Failed to allocate memory for results");
+	for (i = 0; i < *count; i++) {
+		t = &trials[i];
+		if (t->workers == workers && t->metadata_batch == metadata_batch && t->small_file == small_file)
+			return t;
+	}
+	if (*count >= TREE_TRIALS) {
+		fprintf(stderr, "Exceeded maximum runs.\n");
 		exit(1);
 	}
-	memset(results, 0, MAX_RUNS * sizeof(RunResult));
-
-	for (processes_per_cpu = 1; processes_per_cpu <= 6; processes_per_cpu++) {
-		num_processes = processes_per_cpu * num_cpus;
-		for (i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]); i++) {
-			if (run_index >= MAX_RUNS) {
-				fprintf(stderr, "Exceeded maximum runs.\n");
-				break;
-			}
+	t = &trials[(*count)++];
+	t->workers = workers;
+	t->metadata_batch = metadata_batch;
+	t->small_file = small_file;
+	opts.metadata_batch = metadata_batch;
+	opts.small_file = small_file;
 
-			/* drop caches to flush page cache */
-			drop_caches();
+	/* the previous trial's writeback and deletes must not run into this one */
+	remove_tree(scratch);
+	sync();
+	drop_caches();
+	printf("Testing with -p %d --metadata-batch %d --small-files %lld\n", workers, metadata_batch, (long long)small_file);
+	link_table_init(&links);
+	stream_tree(workers, block_size, engine, source, scratch, &links, &opts, &t->result);
+	link_table_free(&links);
+	remove_tree(scratch);
+	return t;
+}
 
-			/* shift starts at 6 and goes to 10 */
-			shift_value = 6 + i;
-			printf("Testing with -p %d and -s %d (%zu KiB)\n", num_processes, shift_value, block_sizes[i] / 1024);
-			results[run_index].shift_value = shift_value;
-			perform_copy(num_processes, block_sizes[i], source_file, dest_file, &results[run_index]);
+static int faster_tree(const TreeTrial *a, const TreeTrial *b) {
+	if (a->result.failed != b->result.failed)
+		return b->result.failed;
+	return a->result.files_per_sec > b->result.files_per_sec;
+}
 
-			/* remove destination file for next run */
-			if (unlink(dest_file) < 0) {
-				perror("Error deleting destination file");
-				free(results);
-				exit(1);
-			}
+void find_tree_settings(const CopyEngine *engine, size_t block_size, int shift_value, const char *source_dir,
+						const char *dest_dir, const char *sample, const CopyOptions *opts) {
+	static const int batches[] = { 1, 4, 16, 64 };
+	static const off_t thresholds[] = { 0, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024 };
+	char source[PATH_MAX], scratch[PATH_MAX], parent[PATH_MAX - 32];
+	TreeTrial trials[TREE_TRIALS], *best, *t;
+	int count = 0, i, workers;
+	size_t len;
+	Profile profile;
 
-			run_index++;
+	snprintf(scratch, sizeof(scratch), "%s/%s", dest_dir, TREE_SCRATCH);
+	snprintf(source, sizeof(source), "%s", source_dir);
+	if (sample != NULL) {
+		/* the parent is on the source filesystem unless the source is a mount point */
+		snprintf(source, sizeof(source), "%s", source_dir);
+		for (len = strlen(source); len > 1 && source[len - 1] == '/'; len--)
+			source[len - 1] = '\0';
+		parent_dir(source, parent, sizeof(parent));
+		snprintf(source, sizeof(source), "%s/%s", parent, TREE_SAMPLE);
+		if (mkdtemp(source) == NULL) {
+			fprintf(stderr, "Error creating the sample directory in %s: %s\n", parent, strerror(errno));
+			exit(1);
 		}
+		if (!same_filesystem(source, source_dir))
+			printf("Warning: the sample is not on the filesystem of %s, the profile is saved for its own.\n",
+				   source_dir);
+		generate_tree(source, sample);
 	}
 
-	/* sort the results based on elapsed_time (ascending) */
-	qsort(results, run_index, sizeof(RunResult), compare_run_results);
+	/* files in flight first, with batching on, then the batch size, then the threshold */
+	best = tree_trial(trials, &count, 1, 16, 64 * 1024, engine, block_size, source, scratch, opts);
+	for (workers = 2; workers <= 64; workers *= 2) {
+		t = tree_trial(trials, &count, workers, 16, 64 * 1024, engine, block_size, source, scratch, opts);
+		if (faster_tree(t, best))
+			best = t;
+	}
+	workers = best->workers;
+	for (i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+		t = tree_trial(trials, &count, workers, batches[i], 64 * 1024, engine, block_size, source, scratch, opts);
+		if (faster_tree(t, best))
+			best = t;
+	}
+	for (i = 0; i < sizeof(thresholds) / sizeof(thresholds[0]); i++) {
+		t = tree_trial(trials, &count, workers, best->metadata_batch, thresholds[i], engine, block_size, source,
+					   scratch, opts);
+		if (faster_tree(t, best))
+			best = t;
+	}
 
-	printf("\nFastest 5 runs:\n");
-	for (i = 0; i < 5 && i < run_index; i++) {
-		printf("Run %d: -p %d -s %d (%zu KiB), %.2f seconds\n", i + 1,
-			   results[i].num_processes, results[i].shift_value, results[i].block_size / 1024, results[i].elapsed_time);
+	printf("\n%8s %6s %12s %10s %12s %10s\n", "workers", "batch", "small files", "files/s", "MiB/s", "metadata");
+	for (i = 0; i < count; i++) {
+		t = &trials[i];
+		if (t->result.failed)
+			printf("%8d %6d %12lld %10s\n", t->workers, t->metadata_batch, (long long)t->small_file, "failed");
+		else
+			printf("%8d %6d %12lld %10.0f %12.2f %8.1fus%s\n", t->workers, t->metadata_batch, (long long)t->small_file,
+				   t->result.files_per_sec, t->result.throughput, t->result.meta_latency * 1e6, t == best ? "  *" : "");
 	}
 
-	printf("\nSlowest 5 runs:\n");
-	for (i = run_index - 1; i >= run_index - 5 && i >= 0; i--) {
-		printf("Run %d: -p %d -s %d (%zu KiB), %.2f seconds\n", run_index - i,
-			   results[i].num_processes, results[i].shift_value, results[i].block_size / 1024, results[i].elapsed_time);
+	if (best->result.failed) {
+		printf("\nNo trial succeeded, no profile saved.\n");
+		if (sample != NULL)
+			remove_tree(source);
+		return;
 	}
+	printf("\nBest: -p %d --metadata-batch %d --small-files %lld, %.0f files/s, %.2f MiB/s\n", best->workers,
+		   best->metadata_batch, (long long)best->small_file, best->result.files_per_sec, best->result.throughput);
+	snprintf(profile.engine, sizeof(profile.engine), "%s", engine->name);
+	profile.workers = best->workers;
+	profile.shift = shift_value;
+	profile.throughput = best->result.throughput;
+	profile.saved_at = time(NULL);
+	profile.metadata_batch = best->metadata_batch;
+	profile.small_file = best->small_file;
+	profile.files_per_sec = best->result.files_per_sec;
+	/* keyed by the sample, which is where the trials read from */
+	profile_save("tree", source, dest_dir, &profile);
+	if (sample != NULL)
+		remove_tree(source);
+}
 
-	free(results);
+void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [options] <source> <destination>\n", prog);
+	fprintf(stderr, "       %s [options] <source>... <directory>\n", prog);
+	fprintf(stderr, "       %s [options] --manifest FILE <directory>\n", prog);
+	fprintf(stderr, "       %s [options] -R <source directory> <destination directory>\n", prog);
+	fprintf(stderr, "       %s [options] --store DIR [--cdc] <source> <recipe>\n", prog);
+	fprintf(stderr, "       %s [options] --restore DIR <recipe> <destination>\n", prog);
+	fprintf(stderr, "       %s [options] --erasure K+M <source> <shard>...\n", prog);
+	fprintf(stderr, "       %s [options] --reconstruct <shard>... <destination>\n", prog);
+	fprintf(stderr, "       %s [options] --encrypt KEYFILE | --decrypt KEYFILE <source> <destination>\n", prog);
+	fprintf(stderr, "       %s [options] --replay TRACE <source> <destination>\n", prog);
+	fprintf(stderr, "       %s [options] --tenants N[,N...] <dataset directory> <destination directory>\n", prog);
+	fprintf(stderr, "       %s -E\n", prog);
+	fprintf(stderr, "  -p, --processes N    number of worker processes\n");
+	fprintf(stderr, "  -s, --shift N        block size of 64 KiB << (N - 6)\n");
+	fprintf(stderr, "  -e, --engine NAME    copy engine, -E lists them\n");
+	fprintf(stderr, "  -o, --optimize       try worker counts, block sizes and engines (root),\n");
+	fprintf(stderr, "                       the pick is saved as the device pair's profile; with -R try\n");
+	fprintf(stderr, "                       workers, --metadata-batch and --small-files for the most files/s\n");
+	fprintf(stderr, "      --interference LOAD  with -o, run each trial next to a background load:\n");
+	fprintf(stderr, "                       randread[:N] on the source, seqwrite[:N] beside the destination,\n");
+	fprintf(stderr, "                       and rank the trials by the harm done to its latency\n");
+	fprintf(stderr, "      --explain        show the plan and predicted duration without copying\n");
+	fprintf(stderr, "      --snapshot       copy from an instant FICLONE snapshot of the source\n");
+	fprintf(stderr, "  -d, --deadline WHEN  finish by WHEN (+45m, 2h, 23:30) using as few resources as possible,\n");
+	fprintf(stderr, "                       -p becomes the most workers it may ramp up to\n");
+	fprintf(stderr, "  -r, --reference FILE reflink chunks that match FILE (same filesystem as the destination)\n");
+	fprintf(stderr, "  -P, --priority LIST  copy and flush these ranges first: head:SIZE, tail:SIZE,\n");
+	fprintf(stderr, "                       ends:SIZE or OFFSET:LENGTH, comma separated\n");
+	fprintf(stderr, "      --sample SECONDS record throughput, dirty and writeback pages and throttled\n");
+	fprintf(stderr, "                       workers every SECONDS and report the time series\n");
+	fprintf(stderr, "      --sample-csv FILE also write the samples to FILE (every second by default)\n");
+	fprintf(stderr, "      --record TRACE   log every chunk: start, latency, offset, length and worker\n");
+	fprintf(stderr, "      --replay TRACE   issue the chunks of TRACE again with the same workers and timing,\n");
+	fprintf(stderr, "                       -e picks another engine, -r clones the recorded clones again\n");
+	fprintf(stderr, "      --replay-fast    replay without waiting for the recorded start times\n");
+	fprintf(stderr, "multi-tenant benchmark options:\n");
+	fprintf(stderr, "      --tenants LIST   run N concurrent copy jobs for each N in LIST (2,4,16) and report\n");
+	fprintf(stderr, "                       aggregate and per-job throughput, fairness and completion times\n");
+	fprintf(stderr, "      --tenant-settings LIST  per-job WORKERS:SHIFT[:ENGINE], comma separated, cycled\n");
+	fprintf(stderr, "                       over the jobs (default -p, -s and -e)\n");
+	fprintf(stderr, "      --dataset-size SIZE  size of each job's generated source file (256M)\n");
+	fprintf(stderr, "batch and tree options:\n");
+	fprintf(stderr, "  -R, --tree           copy the contents of a directory recursively, streaming the\n");
+	fprintf(stderr, "                       walk unless --order, --explain or -d need the whole list\n");
+	fprintf(stderr, "      --manifest FILE  copy the files listed in FILE, one SOURCE[<TAB>DEST] per line\n");
+	fprintf(stderr, "      --order ORDER    given (default), largest (shortest makespan) or\n");
+	fprintf(stderr, "                       smallest (shortest mean completion time) first\n");
+	fprintf(stderr, "      --lookahead N    open, prefetch and preallocate the next N files while copying,\n");
+	fprintf(stderr, "                       hinting at most 64 MiB across the window\n");
+	fprintf(stderr, "      --small-files SIZE  with -R, copy files up to SIZE whole, queued by name\n");
+	fprintf(stderr, "      --metadata-batch N  with --small-files, queue N small files per record (1)\n");
+	fprintf(stderr, "      --tree-sample FILES[:SIZE]  with -o -R, tune on FILES generated files of up to SIZE\n");
+	fprintf(stderr, "                       (1M) beside the source instead of the source tree\n");
+	fprintf(stderr, "chunk store options:\n");
+	fprintf(stderr, "      --store DIR      keep each distinct chunk once in DIR, write the file's recipe\n");
+	fprintf(stderr, "      --cdc            content defined chunks averaging the block size (-s)\n");
+	fprintf(stderr, "      --restore DIR    rebuild a file from its recipe and the chunks in DIR\n");
+	fprintf(stderr, "erasure coding options:\n");
+	fprintf(stderr, "      --erasure K+M    write K data and M parity shards, one per path, stripes of K blocks (-s)\n");
+	fprintf(stderr, "      --reconstruct    rebuild the source from any K of its shards\n");
+	fprintf(stderr, "encryption options:\n");
+	fprintf(stderr, "      --encrypt KEYFILE write an AES-GCM container, chunks of the block size (-s)\n");
+	fprintf(stderr, "      --decrypt KEYFILE authenticate and decrypt a container\n");
+	fprintf(stderr, "                       KEYFILE holds a 128 or 256 bit key, raw or in hex\n");
+	fprintf(stderr, "cgroup options (cgroup v2, root):\n");
+	fprintf(stderr, "  --memory-high SIZE   throttle page cache growth of the copy above SIZE\n");
+	fprintf(stderr, "  --memory-max SIZE    hard limit on the memory charged to the copy\n");
+	fprintf(stderr, "  --read-bps RATE      io.max read bandwidth on the source disk, bytes/s\n");
+	fprintf(stderr, "  --write-bps RATE     io.max write bandwidth on the destination disk, bytes/s\n");
+}
+
+static int is_directory(const char *path) {
+	struct stat st;
+
+	return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
 }
 
 int main(int argc, char *argv[]) {
-	int opt;
+	int opt, rc = 0;
 	int num_processes = 0;
 	int shift_value = 0;
 	int optimize = 0;
 	size_t block_size;
+	const CopyEngine *engine = NULL;
+	CopyOptions opts = { 0 };
+	const char *source_file, *dest_file;
+	char snapshot_path[64];
+	int snapshot = 0, snapshot_fd = -1;
+	const char *manifest = NULL;
+	int tree = 0, batch = 0, order = ORDER_GIVEN, nargs, stream = 0;
+	LinkTable links;
+	CopyPlan plan;
+	int explain = 0, have_profile = 0;
+	const char *settings_from = "command line and defaults";
+	Profile profile;
+	const char *store = NULL, *restore = NULL;
+	int cdc = 0;
+	const char *erasure = NULL;
+	int reconstruct = 0, k, m;
+	const char *key_file = NULL;
+	int decrypt = 0;
+	const char *replay = NULL;
+	int replay_fast = 0;
+	const char *tenants = NULL, *tenant_spec = NULL;
+	TenantSettings tenant_settings[TENANT_MAX];
+	off_t dataset_size = 256 * 1024 * 1024;
+	const char *tree_sample = NULL, *profile_kind = NULL;
+	int small_set = 0, batch_set = 0;
+	enum {
+		OPT_MEMORY_HIGH = 256,
+		OPT_MEMORY_MAX,
+		OPT_READ_BPS,
+		OPT_WRITE_BPS,
+		OPT_SNAPSHOT,
+		OPT_MANIFEST,
+		OPT_ORDER,
+		OPT_EXPLAIN,
+		OPT_STORE,
+		OPT_RESTORE,
+		OPT_CDC,
+		OPT_ERASURE,
+		OPT_RECONSTRUCT,
+		OPT_SAMPLE,
+		OPT_SAMPLE_CSV,
+		OPT_ENCRYPT,
+		OPT_DECRYPT,
+		OPT_RECORD,
+		OPT_REPLAY,
+		OPT_REPLAY_FAST,
+		OPT_INTERFERENCE,
+		OPT_LOOKAHEAD,
+		OPT_TENANTS,
+		OPT_TENANT_SETTINGS,
+		OPT_DATASET_SIZE,
+		OPT_SMALL_FILES,
+		OPT_METADATA_BATCH,
+		OPT_TREE_SAMPLE,
+	};
+	static const struct option long_options[] = {
+		{ "processes", required_argument, NULL, 'p' },
+		{ "shift", required_argument, NULL, 's' },
+		{ "optimize", no_argument, NULL, 'o' },
+		{ "engine", required_argument, NULL, 'e' },
+		{ "list-engines", no_argument, NULL, 'E' },
+		{ "reference", required_argument, NULL, 'r' },
+		{ "priority", required_argument, NULL, 'P' },
+		{ "snapshot", no_argument, NULL, OPT_SNAPSHOT },
+		{ "deadline", required_argument, NULL, 'd' },
+		{ "tree", no_argument, NULL, 'R' },
+		{ "manifest", required_argument, NULL, OPT_MANIFEST },
+		{ "order", required_argument, NULL, OPT_ORDER },
+		{ "explain", no_argument, NULL, OPT_EXPLAIN },
+		{ "store", required_argument, NULL, OPT_STORE },
+		{ "restore", required_argument, NULL, OPT_RESTORE },
+		{ "cdc", no_argument, NULL, OPT_CDC },
+		{ "erasure", required_argument, NULL, OPT_ERASURE },
+		{ "reconstruct", no_argument, NULL, OPT_RECONSTRUCT },
+		{ "sample", required_argument, NULL, OPT_SAMPLE },
+		{ "sample-csv", required_argument, NULL, OPT_SAMPLE_CSV },
+		{ "encrypt", required_argument, NULL, OPT_ENCRYPT },
+		{ "decrypt", required_argument, NULL, OPT_DECRYPT },
+		{ "record", required_argument, NULL, OPT_RECORD },
+		{ "replay", required_argument, NULL, OPT_REPLAY },
+		{ "replay-fast", no_argument, NULL, OPT_REPLAY_FAST },
+		{ "interference", required_argument, NULL, OPT_INTERFERENCE },
+		{ "lookahead", required_argument, NULL, OPT_LOOKAHEAD },
+		{ "tenants", required_argument, NULL, OPT_TENANTS },
+		{ "tenant-settings", required_argument, NULL, OPT_TENANT_SETTINGS },
+		{ "dataset-size", required_argument, NULL, OPT_DATASET_SIZE },
+		{ "small-files", required_argument, NULL, OPT_SMALL_FILES },
+		{ "metadata-batch", required_argument, NULL, OPT_METADATA_BATCH },
+		{ "tree-sample", required_argument, NULL, OPT_TREE_SAMPLE },
+		{ "memory-high", required_argument, NULL, OPT_MEMORY_HIGH },
+		{ "memory-max", required_argument, NULL, OPT_MEMORY_MAX },
+		{ "read-bps", required_argument, NULL, OPT_READ_BPS },
+		{ "write-bps", required_argument, NULL, OPT_WRITE_BPS },
+		{ NULL, 0, NULL, 0 }
+	};
 
 	about();
 
 	/* parse command line arguments */
-	while ((opt = getopt(argc, argv, "p:s:o")) != -1) {
+	while ((opt = getopt_long(argc, argv, "p:s:oe:Er:P:d:R", long_options, NULL)) != -1) {
 		switch (opt) {
 			case 'p':
 				num_processes = atoi(optarg);
@@ -271,16 +5872,333 @@ int main(int argc, char *argv[]) {
 					exit(1);
 				}
 				break;
+			case 'e':
+				engine = find_engine(optarg);
+				if (engine == NULL) {
+					fprintf(stderr, "Unknown copy engine '%s', use -E to list them.\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'E':
+				list_engines();
+				return 0;
+			case 'r':
+				opts.reference_file = optarg;
+				break;
+			case 'P':
+				opts.priority_spec = optarg;
+				break;
+			case 'd':
+				opts.deadline = parse_deadline(optarg);
+				break;
+			case OPT_MEMORY_HIGH:
+				opts.cgroup.memory_high = parse_size(optarg);
+				break;
+			case OPT_MEMORY_MAX:
+				opts.cgroup.memory_max = parse_size(optarg);
+				break;
+			case OPT_READ_BPS:
+				opts.cgroup.rbps = parse_size(optarg);
+				break;
+			case OPT_WRITE_BPS:
+				opts.cgroup.wbps = parse_size(optarg);
+				break;
+			case OPT_SNAPSHOT:
+				snapshot = 1;
+				break;
+			case 'R':
+				tree = 1;
+				break;
+			case OPT_EXPLAIN:
+				explain = 1;
+				break;
+			case OPT_MANIFEST:
+				manifest = optarg;
+				break;
+			case OPT_STORE:
+				store = optarg;
+				break;
+			case OPT_RESTORE:
+				restore = optarg;
+				break;
+			case OPT_CDC:
+				cdc = 1;
+				break;
+			case OPT_ERASURE:
+				erasure = optarg;
+				break;
+			case OPT_RECONSTRUCT:
+				reconstruct = 1;
+				break;
+			case OPT_SAMPLE:
+				opts.sample_interval = atof(optarg);
+				if (opts.sample_interval <= 0.0) {
+					fprintf(stderr, "Invalid sample interval '%s'\n", optarg);
+					exit(1);
+				}
+				break;
+			case OPT_ENCRYPT:
+			case OPT_DECRYPT:
+				key_file = optarg;
+				decrypt = opt == OPT_DECRYPT;
+				break;
+			case OPT_TENANTS:
+				tenants = optarg;
+				break;
+			case OPT_TENANT_SETTINGS:
+				tenant_spec = optarg;
+				break;
+			case OPT_DATASET_SIZE:
+				dataset_size = parse_size(optarg);
+				break;
+			case OPT_SMALL_FILES:
+				opts.small_file = parse_size(optarg);
+				small_set = 1;
+				break;
+			case OPT_METADATA_BATCH:
+				opts.metadata_batch = atoi(optarg);
+				if (opts.metadata_batch < 1) {
+					fprintf(stderr, "Invalid metadata batch '%s'\n", optarg);
+					exit(1);
+				}
+				batch_set = 1;
+				break;
+			case OPT_TREE_SAMPLE:
+				tree_sample = optarg;
+				break;
+			case OPT_LOOKAHEAD:
+				opts.lookahead = atoi(optarg);
+				if (opts.lookahead < 0) {
+					fprintf(stderr, "Invalid lookahead '%s'\n", optarg);
+					exit(1);
+				}
+				break;
+			case OPT_INTERFERENCE:
+				opts.interference = optarg;
+				break;
+			case OPT_RECORD:
+				opts.record_file = optarg;
+				break;
+			case OPT_REPLAY:
+				replay = optarg;
+				break;
+			case OPT_REPLAY_FAST:
+				replay_fast = 1;
+				break;
+			case OPT_SAMPLE_CSV:
+				opts.sample_csv = optarg;
+				if (opts.sample_interval == 0.0)
+					opts.sample_interval = 1.0;
+				break;
+			case OPT_ORDER:
+				if (strcmp(optarg, "given") == 0 || strcmp(optarg, "manifest") == 0)
+					order = ORDER_GIVEN;
+				else if (strcmp(optarg, "largest") == 0 || strcmp(optarg, "lpt") == 0)
+					order = ORDER_LARGEST;
+				else if (strcmp(optarg, "smallest") == 0 || strcmp(optarg, "spt") == 0)
+					order = ORDER_SMALLEST;
+				else {
+					fprintf(stderr, "Unknown order '%s'\n", optarg);
+					exit(1);
+				}
+				break;
 			default:
-				fprintf(stderr, "Usage: %s [-p num_processes] [-s shift_value] [-o] <source> <destination>\n", argv[0]);
+				usage(argv[0]);
 				return 1;
 		}
 	}
 
-	if (optind + 2 > argc) {
-		fprintf(stderr, "Usage: %s [-p num_processes] [-s shift_value] [-o] <source> <destination>\n", argv[0]);
+	nargs = argc - optind;
+	if (nargs < (manifest != NULL ? 1 : 2) || (tree && nargs != 2) || (manifest != NULL && (tree || nargs != 1))) {
+		usage(argv[0]);
 		return 1;
 	}
+	source_file = argv[optind];
+	dest_file = argv[argc - 1];
+
+	if (tenants != NULL) {
+		int count = 1;
+
+		if (nargs != 2 || !is_directory(source_file) || !is_directory(dest_file)) {
+			fprintf(stderr, "--tenants takes a directory for the datasets and a destination directory.\n");
+			exit(1);
+		}
+		if (tenant_spec != NULL) {
+			count = parse_tenant_settings(tenant_spec, tenant_settings, TENANT_MAX);
+		} else {
+			tenant_settings[0].workers = num_processes > 0 ? num_processes : get_nprocs() * 4;
+			tenant_settings[0].shift = shift_value > 0 ? shift_value : 10;
+			tenant_settings[0].engine = engine;
+		}
+		for (int i = 0; i < count; i++)
+			if (tenant_settings[i].engine == NULL)
+				tenant_settings[i].engine = engine != NULL ? engine : engines[0];
+		tenant_benchmark(tenants, tenant_settings, count, dataset_size, source_file, dest_file, &opts);
+		return 0;
+	}
+
+	if (replay != NULL) {
+		if (nargs != 2) {
+			fprintf(stderr, "--replay takes one source and one destination.\n");
+			exit(1);
+		}
+		return replay_trace(replay, source_file, dest_file, engine, opts.reference_file, replay_fast);
+	}
+
+	if (key_file != NULL) {
+		if (nargs != 2 || tree || manifest != NULL || optimize || explain || store != NULL || restore != NULL ||
+			erasure != NULL || reconstruct) {
+			fprintf(stderr, "--encrypt and --decrypt take one source and one destination.\n");
+			exit(1);
+		}
+		if (num_processes == 0)
+			num_processes = get_nprocs();
+		if (shift_value == 0)
+			block_size = 64 * 1024 * (1 << (10 - 6));
+		return crypt_file(num_processes, block_size, key_file, decrypt, source_file, dest_file);
+	}
+
+	if (erasure != NULL || reconstruct) {
+		if (erasure != NULL && reconstruct) {
+			fprintf(stderr, "--erasure and --reconstruct cannot be combined.\n");
+			exit(1);
+		}
+		if (num_processes == 0)
+			num_processes = get_nprocs();
+		if (shift_value == 0)
+			block_size = 64 * 1024 * (1 << (10 - 6));
+		if (reconstruct)
+			return erasure_reconstruct(num_processes, argv + optind, nargs - 1, dest_file);
+		parse_erasure(erasure, &k, &m);
+		if (nargs != 1 + k + m) {
+			fprintf(stderr, "--erasure %d+%d needs a source and %d shard paths.\n", k, m, k + m);
+			exit(1);
+		}
+		return erasure_encode(num_processes, block_size, k, m, source_file, argv + optind + 1);
+	}
+
+	if (store != NULL || restore != NULL) {
+		if (nargs != 2 || (store != NULL && restore != NULL) || tree || manifest != NULL || optimize || explain ||
+			snapshot || opts.reference_file != NULL || opts.priority_spec != NULL || opts.deadline > 0.0) {
+			fprintf(stderr, "--store and --restore take one source and one destination, without -o, -r, -P, -d,\n"
+							"--snapshot, --explain or batch and tree options.\n");
+			exit(1);
+		}
+		if (num_processes == 0)
+			num_processes = get_nprocs();
+		if (shift_value == 0)
+			block_size = 64 * 1024 * (1 << (10 - 6));
+		if (store != NULL) {
+			printf("Storing with %d processes, %s chunks of %zu KiB%s.\n", num_processes,
+				   cdc ? "content defined" : "fixed", block_size / 1024, cdc ? " on average" : "");
+			return store_file(num_processes, block_size, cdc, store, source_file, dest_file);
+		} else {
+			RunResult result;
+			if (engine == NULL)
+				engine = engines[0];
+			printf("Restoring with %d processes using %s.\n", num_processes, engine->name);
+			restore_file(num_processes, block_size, engine, restore, source_file, dest_file, &opts, &result);
+			return result.failed ? 1 : 0;
+		}
+	}
+	if (optimize && tree) {
+		if (nargs != 2 || explain || manifest != NULL || order != ORDER_GIVEN || snapshot || opts.deadline > 0.0 ||
+			opts.reference_file != NULL || opts.priority_spec != NULL || opts.record_file != NULL ||
+			opts.interference != NULL) {
+			fprintf(stderr, "-o -R tunes a tree copy of one directory into another, without --explain, --manifest,\n"
+							"--order, --snapshot, -d, -r, -P, --record or --interference.\n");
+			exit(1);
+		}
+		if (!is_directory(source_file)) {
+			fprintf(stderr, "%s is not a directory.\n", source_file);
+			exit(1);
+		}
+		if (mkdir(dest_file, 0755) < 0 && errno != EEXIST) {
+			fprintf(stderr, "Error creating directory %s: %s\n", dest_file, strerror(errno));
+			exit(1);
+		}
+		if (shift_value == 0) {
+			shift_value = 10;
+			block_size = 64 * 1024 * (1 << (shift_value - 6));
+		}
+		find_tree_settings(engine != NULL ? engine : engines[0], block_size, shift_value, source_file, dest_file,
+						   tree_sample, &opts);
+		return 0;
+	}
+	if (tree_sample != NULL) {
+		fprintf(stderr, "--tree-sample is the sample for the tree optimizer, use it with -o -R.\n");
+		exit(1);
+	}
+
+	/* several sources, or a file and a directory, copy into that directory */
+	batch = tree || manifest != NULL || nargs > 2 || (is_directory(dest_file) && !is_directory(source_file));
+
+	if (batch) {
+		if (optimize || opts.reference_file != NULL || opts.priority_spec != NULL || snapshot) {
+			fprintf(stderr, "-o, -r, -P and --snapshot work on a single file, not in batch or tree mode.\n");
+			exit(1);
+		}
+		if (!tree && !is_directory(dest_file)) {
+			fprintf(stderr, "The destination %s is not a directory.\n", dest_file);
+			exit(1);
+		}
+
+		/* sorting, previews and deadlines need the whole list, otherwise a tree is streamed */
+		stream = tree && order == ORDER_GIVEN && !explain && opts.deadline == 0.0 && opts.record_file == NULL;
+
+		/* the block size is known below, files are laid out into chunks then */
+		plan_init(&plan, 0);
+		if (tree)
+			link_table_init(&links);
+		if (stream)
+			;
+		else if (tree)
+			tree_walk(&plan, &links, source_file, dest_file, !explain);
+		else if (manifest != NULL)
+			batch_add_manifest(&plan, manifest, dest_file);
+		else
+			batch_add_args(&plan, argv + optind, nargs - 1, dest_file);
+		if (plan.file_count == 0 && !stream) {
+			printf("Nothing to copy.\n");
+			return 0;
+		}
+		/* the first file stands in for the source device below */
+		if (!stream)
+			source_file = plan.files[0].source;
+	}
+	if (!stream && (small_set || batch_set)) {
+		fprintf(stderr, "--small-files and --metadata-batch apply to streamed tree copies (-R).\n");
+		exit(1);
+	}
+
+	/* settings not given on the command line come from the device pair's profile, its tree profile for a streamed tree */
+	if (!optimize && (engine == NULL || num_processes == 0 || shift_value == 0 || (stream && (!small_set || !batch_set)))) {
+		if (stream && profile_load("tree", source_file, dest_file, &profile) == 0)
+			profile_kind = "tree";
+		else if ((engine == NULL || num_processes == 0 || shift_value == 0) &&
+				 profile_load("copy", source_file, dest_file, &profile) == 0)
+			profile_kind = "copy";
+	}
+	if (profile_kind != NULL) {
+		have_profile = 1;
+		if (engine == NULL && (engine = find_engine(profile.engine)) != NULL)
+			settings_from = "profile of this device pair";
+		if (num_processes == 0) {
+			num_processes = profile.workers;
+			settings_from = "profile of this device pair";
+		}
+		if (shift_value == 0 && profile.shift >= 6) {
+			shift_value = profile.shift;
+			block_size = 64 * 1024 * (1 << (shift_value - 6));
+			settings_from = "profile of this device pair";
+		}
+		if (strcmp(profile_kind, "tree") == 0) {
+			if (!small_set)
+				opts.small_file = profile.small_file;
+			if (!batch_set)
+				opts.metadata_batch = profile.metadata_batch;
+		}
+	}
 
 	if (num_processes == 0) {
 		int num_cpus = get_nprocs();
@@ -293,13 +6211,99 @@ int main(int argc, char *argv[]) {
 		block_size = 64 * 1024 * (1 << (shift_value - 6));
 	}
 
+	if (batch) {
+		plan.block_size = block_size;
+		plan_order(&plan, order);
+	}
+	if (have_profile && !explain && strcmp(profile_kind, "tree") == 0)
+		printf("Using the tree profile of this device pair (-e %s -p %d -s %d --metadata-batch %d --small-files %lld,\n"
+			   "%.0f files/s, %.2f MiB/s) for settings not given.\n", profile.engine, profile.workers, profile.shift,
+			   profile.metadata_batch, profile.small_file, profile.files_per_sec, profile.throughput);
+	else if (have_profile && !explain)
+		printf("Using the profile of this device pair (-e %s -p %d -s %d, %.2f MiB/s) for settings not given.\n",
+			   profile.engine, profile.workers, profile.shift, profile.throughput);
+
+	if (optimize && opts.deadline > 0.0) {
+		fprintf(stderr, "The optimizer always runs at full speed, -d cannot be used with -o.\n");
+		exit(1);
+	}
+	if (!optimize && opts.interference != NULL) {
+		fprintf(stderr, "--interference is for optimizer trials, use it with -o.\n");
+		exit(1);
+	}
+	if (optimize && opts.record_file != NULL) {
+		fprintf(stderr, "--record traces one copy, it cannot be used with -o.\n");
+		exit(1);
+	}
+
+	if (opts.reference_file != NULL && !same_filesystem(opts.reference_file, dest_file)) {
+		fprintf(stderr, "The reference file must be on the destination filesystem.\n");
+		exit(1);
+	}
+
+	if (explain) {
+		if (optimize) {
+			fprintf(stderr, "--explain previews a copy, it cannot be used with -o.\n");
+			exit(1);
+		}
+		if (engine == NULL)
+			engine = engines[0];
+		if (!batch) {
+			struct stat st;
+			if (stat(source_file, &st) < 0) {
+				perror("Error getting file status");
+				exit(1);
+			}
+			plan_build(&plan, source_file, dest_file, &st, block_size, opts.priority_spec);
+		}
+		explain_copy(&plan, num_processes, engine, settings_from, dest_file, &opts, snapshot, have_profile ? &profile : NULL);
+		plan_free(&plan);
+		return 0;
+	}
+
+	if (opts.cgroup.memory_high || opts.cgroup.memory_max || opts.cgroup.rbps || opts.cgroup.wbps) {
+		if (geteuid() != 0) {
+			fprintf(stderr, "You need to be root to confine the copy to a cgroup.\n");
+			exit(1);
+		}
+		cgroup_create(&opts.cgroup, source_file, dest_file);
+		cgroup_remove_at_exit(&opts.cgroup);
+	}
+
+	if (snapshot) {
+		snapshot_fd = snapshot_source(source_file, snapshot_path, sizeof(snapshot_path));
+		source_file = snapshot_path;
+	}
+
 	if (optimize) {
-		find_optimal_settings(argv[optind], argv[optind + 1]);
+		find_optimal_settings(engine, source_file, dest_file, &opts);
 	} else {
 		RunResult result;
-		printf("Starting %d processes with a transfer size of %zu KiB per block.\n", num_processes, block_size / 1024);
-		perform_copy(num_processes, block_size, argv[optind], argv[optind + 1], &result);
+		if (engine == NULL)
+			engine = engines[0];
+		if (!engine_usable(engine, source_file, dest_file))
+			fprintf(stderr, "Warning: the %s engine may not work across filesystems.\n", engine->name);
+		if (opts.deadline > 0.0)
+			printf("Starting with 1 of up to %d processes with a transfer size of %zu KiB per block using %s.\n", num_processes, block_size / 1024, engine->name);
+		else
+			printf("Starting %d processes with a transfer size of %zu KiB per block using %s.\n", num_processes, block_size / 1024, engine->name);
+		if (stream) {
+			stream_tree(num_processes, block_size, engine, source_file, dest_file, &links, &opts, &result);
+		} else if (batch) {
+			printf("Copying %d files (%.2f MiB).\n", plan.file_count, plan.total_bytes / (1024.0 * 1024.0));
+			run_plan(&plan, num_processes, engine, &opts, &result);
+			plan_free(&plan);
+		} else {
+			perform_copy(num_processes, block_size, engine, source_file, dest_file, &opts, &result);
+		}
+		rc = result.failed ? 1 : 0;
 	}
+	/* paths that exit early leave the cgroup to cgroup_cleanup() */
+	cgroup_finish(&opts.cgroup);
+	if (snapshot_fd >= 0)
+		close(snapshot_fd);
+	if (tree)
+		link_table_free(&links);
 
-	return 0;
+	return rc;
 }